@@ -13,9 +13,14 @@ collect_ignore = ["cysignals/cysignals-CSI-helper.py"]
 if platform.system() == "Windows":
     collect_ignore += [
         "cysignals/alarm.pyx",
+        "cysignals/isolate.pyx",
+        "cysignals/memory.pyx",
+        "cysignals/profiler.pyx",
         "cysignals/pselect.pyx",
         "cysignals/pysignals.pyx",
+        "cysignals/stackdump.pyx",
         "cysignals/tests.pyx",
+        "cysignals/trace.pyx",
     ]
 
 
@@ -1,3 +1,3 @@
-from .signals import AlarmInterrupt, SignalError, init_cysignals  # noqa
+from .signals import AlarmInterrupt, CPUAlarmInterrupt, SignalError, init_cysignals  # noqa
 
 init_cysignals()
@@ -23,8 +23,19 @@ Fine-grained alarm function
 
 from posix.time cimport (setitimer, itimerval, ITIMER_REAL,
         time_t, suseconds_t)
+from cpython.exc cimport PyErr_SetFromErrno
 
-from .signals import AlarmInterrupt
+cdef extern from "alarm_helper.c":
+    int (*cpu_alarm_interrupt)(int sig, int main_thread) noexcept nogil
+    int cpu_alarm_set(double seconds, int main_thread) nogil
+    int cpu_alarm_cancel() nogil
+
+from .signals cimport _sig_interrupt_thread
+from .signals import AlarmInterrupt, CPUAlarmInterrupt
+
+import threading
+
+cpu_alarm_interrupt = _sig_interrupt_thread
 
 
 def alarm(seconds):
@@ -81,6 +92,122 @@ def cancel_alarm():
     setitimer_real(0)
 
 
+def cpu_alarm(seconds):
+    """
+    Raise a :class:`CPUAlarmInterrupt` exception once the current
+    thread used a given number of seconds of CPU time. Unlike
+    :func:`alarm`, time during which the thread sleeps or waits for
+    the CPU is not counted.
+
+    Every thread has its own CPU-time alarm, which is independent of
+    the alarm set by :func:`alarm`. Use :func:`cancel_cpu_alarm` to
+    cancel it. The exception is only raised in the thread which set
+    the alarm: inside ``sig_on()`` in this thread, or outside
+    ``sig_on()`` if this is the main thread. Otherwise (for example
+    while another thread is inside ``sig_on()``), the alarm stays
+    pending and is raised once possible, after the thread used a bit
+    more CPU time.
+
+    The first call installs the handler of ``cysignals`` for the signal
+    ``SIGVTALRM``, replacing any previous handler (for example for
+    ``ITIMER_VIRTUAL``). This is only supported on Linux; on other
+    systems, ``OSError`` is raised.
+
+    INPUT:
+
+    -  ``seconds`` -- positive number, may be floating point
+
+    OUTPUT: None
+
+    EXAMPLES::
+
+        >>> import platform, pytest
+        >>> if platform.system() != 'Linux':
+        ...     pytest.skip('this doctest requires Linux')
+        >>> from cysignals.alarm import cpu_alarm, CPUAlarmInterrupt
+        >>> from cysignals.tests import sig_on_busy_loop
+        >>> from time import sleep
+        >>> try:
+        ...     cpu_alarm(0.2)
+        ...     sleep(0.5)  # Sleeping does not use CPU time
+        ...     print("still waiting")
+        ...     while True:
+        ...         pass
+        ... except CPUAlarmInterrupt:
+        ...     print("CPU alarm!")
+        still waiting
+        CPU alarm!
+        >>> try:
+        ...     cpu_alarm(0.2)
+        ...     sig_on_busy_loop(10)  # Inside sig_on()
+        ... except AlarmInterrupt as e:
+        ...     print(type(e).__name__)
+        CPUAlarmInterrupt
+        >>> cpu_alarm(0)
+        Traceback (most recent call last):
+        ...
+        ValueError: cpu_alarm() time must be positive
+
+    The alarm of another thread does not interrupt ``sig_on()`` in the
+    main thread::
+
+        >>> import threading, time
+        >>> from cysignals.alarm import cancel_cpu_alarm
+        >>> def spin():
+        ...     cpu_alarm(0.1)
+        ...     t = time.monotonic()
+        ...     while time.monotonic() < t + 0.5:
+        ...         pass
+        ...     cancel_cpu_alarm()
+        >>> thread = threading.Thread(target=spin)
+        >>> thread.start()
+        >>> sig_on_busy_loop(1)
+        >>> thread.join()
+        >>> def busy():
+        ...     try:
+        ...         cpu_alarm(0.1)
+        ...         sig_on_busy_loop(10)
+        ...     except CPUAlarmInterrupt:
+        ...         print("CPU alarm in thread")
+        >>> thread = threading.Thread(target=busy)
+        >>> thread.start()
+        >>> thread.join()
+        CPU alarm in thread
+
+    """
+    if seconds <= 0:
+        raise ValueError("cpu_alarm() time must be positive")
+    main = threading.current_thread() is threading.main_thread()
+    if cpu_alarm_set(seconds, main) == -1:
+        PyErr_SetFromErrno(OSError)
+
+
+def cancel_cpu_alarm():
+    """
+    Cancel a previously scheduled CPU-time alarm (if any) of the
+    current thread, set by :func:`cpu_alarm`.
+
+    OUTPUT: None
+
+    EXAMPLES::
+
+        >>> import platform, pytest
+        >>> if platform.system() != 'Linux':
+        ...     pytest.skip('this doctest requires Linux')
+        >>> from cysignals.alarm import cpu_alarm, cancel_cpu_alarm
+        >>> from time import process_time
+        >>> cpu_alarm(0.2)
+        >>> cancel_cpu_alarm()
+        >>> cancel_cpu_alarm()  # Calling more than once doesn't matter
+        >>> t = process_time()
+        >>> while process_time() < t + 0.3:  # no alarm
+        ...     pass
+
+    """
+    if cpu_alarm_cancel() == -1:
+        PyErr_SetFromErrno(OSError)
+
+
 cdef inline void setitimer_real(double x) noexcept:
     cdef itimerval itv
     itv.it_interval.tv_sec = 0
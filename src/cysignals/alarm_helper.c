@@ -0,0 +1,211 @@
+/*
+ * C functions for the CPU-time alarms in alarm.pyx
+ *
+ * Every thread calling cpu_alarm() gets its own POSIX timer measuring
+ * the CPU time of that thread (CLOCK_THREAD_CPUTIME_ID). When the timer
+ * expires, SIGVTALRM is sent to the thread itself. The handler for
+ * SIGVTALRM is only installed by the first cpu_alarm(), such that
+ * other users of SIGVTALRM (such as ITIMER_VIRTUAL) are not affected
+ * otherwise. It raises the interrupt only in the thread whose timer
+ * expired: inside sig_on() if this thread called sig_on(), or outside
+ * sig_on() in the main thread. Otherwise, the alarm stays pending in
+ * the thread and the timer is rearmed to try again after a bit more
+ * CPU time. The timer is deleted when the thread exits.
+ */
+
+/*****************************************************************************
+ *       Copyright (C) 2026 The Sage Developers
+ *
+ * cysignals is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cysignals is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cysignals.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+/* Deliver the signal to the thread owning the timer instead of to an
+ * arbitrary thread of the process. This is required, since the handler
+ * uses the state of the thread receiving the signal. */
+#if defined(__linux__) && defined(SIGEV_THREAD_ID) && defined(SYS_gettid)
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#define CPU_ALARM_THREAD_DIRECTED 1
+#else
+#define CPU_ALARM_THREAD_DIRECTED 0
+#endif
+
+#if HAVE_TIMER_CREATE && defined(CLOCK_THREAD_CPUTIME_ID) && defined(SIGVTALRM) && \
+        CPU_ALARM_THREAD_DIRECTED && defined(__GNUC__)
+#define CPU_ALARM_SUPPORTED 1
+#else
+#define CPU_ALARM_SUPPORTED 0
+#endif
+
+/* CPU time in seconds after which an alarm which could not be raised
+ * is tried again */
+#define CPU_ALARM_RETRY 0.01
+
+/* Raise the interrupt sig if possible in the current thread, see
+ * _sig_interrupt_thread() in implementation.c. Set by alarm.pyx. */
+static int (*cpu_alarm_interrupt)(int sig, int main_thread);
+
+
+#if CPU_ALARM_SUPPORTED
+/* The timer of each thread, created by the first cpu_alarm_set(). The
+ * key is used to delete it when the thread exits. */
+static pthread_key_t cpu_alarm_key;
+static pthread_once_t cpu_alarm_once = PTHREAD_ONCE_INIT;
+static int cpu_alarm_init_error;
+
+static __thread timer_t* cpu_alarm_current;
+/* Is the current thread the main thread? */
+static __thread int cpu_alarm_main;
+
+static int cpu_alarm_settime(timer_t* timer, double seconds)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = (time_t)seconds;  /* Truncate */
+    its.it_value.tv_nsec = (long)((seconds - its.it_value.tv_sec) * 1e9);
+    /* A zero it_value disarms the timer */
+    if (seconds > 0 && its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+        its.it_value.tv_nsec = 1;
+    return timer_settime(*timer, 0, &its, NULL);
+}
+
+/* Handler for SIGVTALRM, installed by the first cpu_alarm_set() */
+static void cpu_alarm_handler(int sig)
+{
+    int saved_errno = errno;
+    if (!cpu_alarm_interrupt(sig, cpu_alarm_main))
+    {
+        /* Another thread is inside sig_on() or this thread cannot
+         * raise an exception outside sig_on(): the alarm stays pending
+         * until the timer expires again */
+        if (cpu_alarm_current) cpu_alarm_settime(cpu_alarm_current, CPU_ALARM_RETRY);
+    }
+    errno = saved_errno;
+}
+
+static void cpu_alarm_delete(void* timer)
+{
+    /* Make sure the handler does not run with a deleted timer */
+    sigset_t block;
+    sigemptyset(&block);
+    sigaddset(&block, SIGVTALRM);
+    pthread_sigmask(SIG_BLOCK, &block, NULL);
+    cpu_alarm_current = NULL;
+    timer_delete(*(timer_t*)timer);
+    free(timer);
+}
+
+static void cpu_alarm_init(void)
+{
+    cpu_alarm_init_error = pthread_key_create(&cpu_alarm_key, cpu_alarm_delete);
+    if (cpu_alarm_init_error) return;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = cpu_alarm_handler;
+    /* Block interrupt-like signals as cysignals does */
+#ifdef SIGHUP
+    sigaddset(&sa.sa_mask, SIGHUP);
+#endif
+    sigaddset(&sa.sa_mask, SIGINT);
+    sigaddset(&sa.sa_mask, SIGALRM);
+    sigaddset(&sa.sa_mask, SIGVTALRM);
+    if (sigaction(SIGVTALRM, &sa, NULL)) cpu_alarm_init_error = errno;
+}
+
+/* Return the timer of the current thread. If there is none, create it
+ * if ``create`` is nonzero and return NULL otherwise. Return NULL with
+ * errno set on failure. */
+static timer_t* cpu_alarm_timer(int create)
+{
+    timer_t* timer = cpu_alarm_current;
+    if (timer || !create) {errno = 0; return timer;}
+
+    pthread_once(&cpu_alarm_once, cpu_alarm_init);
+    if (cpu_alarm_init_error) {errno = cpu_alarm_init_error; return NULL;}
+
+    timer = (timer_t*)malloc(sizeof(timer_t));
+    if (!timer) {errno = ENOMEM; return NULL;}
+
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_signo = SIGVTALRM;
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, timer))
+    {
+        int saved_errno = errno;
+        free(timer);
+        errno = saved_errno;
+        return NULL;
+    }
+    int err = pthread_setspecific(cpu_alarm_key, timer);
+    if (err)
+    {
+        timer_delete(*timer);
+        free(timer);
+        errno = err;
+        return NULL;
+    }
+    cpu_alarm_current = timer;
+    return timer;
+}
+#endif
+
+
+/* Send SIGVTALRM to the current thread once it used ``seconds`` of
+ * CPU time, replacing an earlier CPU-time alarm of this thread.
+ * main_thread is nonzero if this is the main thread. Return 0 on
+ * success, -1 with errno set on failure. */
+static int cpu_alarm_set(double seconds, int main_thread)
+{
+#if CPU_ALARM_SUPPORTED
+    timer_t* timer = cpu_alarm_timer(1);
+    if (!timer) return -1;
+    cpu_alarm_main = main_thread;
+    return cpu_alarm_settime(timer, seconds);
+#else
+    (void)seconds; (void)main_thread;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+
+/* Cancel the CPU-time alarm of the current thread (if any), including
+ * a pending one */
+static int cpu_alarm_cancel(void)
+{
+#if CPU_ALARM_SUPPORTED
+    timer_t* timer = cpu_alarm_timer(0);
+    if (!timer) return errno ? -1 : 0;
+    return cpu_alarm_settime(timer, 0);
+#else
+    return 0;
+#endif
+}
@@ -34,6 +34,7 @@ Interrupt and signal handling for Cython
 #include <stdlib.h>
 #include <limits.h>
 #include <errno.h>
+#include <stdint.h>
 #if HAVE_SYS_TYPES_H
 #include <sys/types.h>
 #endif
@@ -52,6 +53,15 @@ Interrupt and signal handling for Cython
 #if HAVE_SYS_PRCTL_H
 #include <sys/prctl.h>
 #endif
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+#if HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#if HAVE_PPOLL
+#include <poll.h>
+#endif
 #include <Python.h>
 
 // Custom signal handling of other packages.
@@ -89,8 +99,24 @@ void custom_set_pending_signal(int sig){
 #endif
 #if !_WIN32
 #include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/select.h>
+#else
+/* Placeholders for the declarations of sig_cond_wait() */
+typedef struct {int unused;} pthread_mutex_t;
+typedef struct {int unused;} pthread_cond_t;
 #endif
 #include "struct_signals.h"
+#if CYSIGNALS_C_ATOMIC
+#include <stdatomic.h>
+#endif
+#if HAVE_MALLOC_USABLE_SIZE || (defined(_WIN32) && !HAVE_MALLOC_SIZE)
+#include <malloc.h>
+#elif HAVE_MALLOC_SIZE
+#include <malloc/malloc.h>
+#endif
+#include <fenv.h>
 
 
 #if ENABLE_DEBUG_CYSIGNALS
@@ -98,18 +124,34 @@ static struct timespec sigtime;  /* Time of signal */
 #endif
 
 /* The cysigs object (there is a unique copy of this, shared by all
- * Cython modules using cysignals) */
+ * Cython modules using cysignals). With CYSIGNALS_SHARED_LIBRARY, it
+ * is defined in libcysignals instead, see signals.pyx. */
+#if !CYSIGNALS_SHARED_LIBRARY
 static cysigs_t cysigs;
+#endif
+
+/* Imported by modules compiled against this layout of cysigs_t, see
+ * CYSIGNALS_LAYOUT_VERSION in struct_signals.h. Its name must change
+ * together with CYSIGNALS_LAYOUT_VERSION. */
+static int cysigs_layout_2 = CYSIGNALS_LAYOUT_VERSION;
+
+#if CYSIGNALS_HAVE_FPTRAP
+/* The floating-point environment to restore at the end of a sig_on()
+ * region with floating-point traps, see _sig_fptrap_enable() */
+static fenv_t sig_fptrap_env;
+#endif
 
 #if HAVE_SIGPROCMASK
 /* The default signal mask during normal operation,
  * initialized by setup_cysignals_handlers(). */
 static sigset_t default_sigmask;
-
-/* default_sigmask with SIGHUP, SIGINT, SIGALRM added. */
-static sigset_t sigmask_with_sigint;
 #endif
 
+/* If non-negative, the interrupt handler writes the signal number to
+ * this file descriptor when it cannot handle an interrupt immediately,
+ * see sig_cond_wait() */
+static volatile int sig_wake_fd = -1;
+
 #if !_WIN32
 /* A trampoline to jump to after handling a signal. */
 static cyjmp_buf trampoline_setup;
@@ -121,13 +163,34 @@ static void cysigs_interrupt_handler(int sig);
 static void cysigs_signal_handler(int sig);
 
 static void _do_raise_exception(int sig);
+static int _sig_cancel(void);
+static void _sig_heartbeat(void);
+static void _sig_stack_release(void);
+static void _sig_fptrap_enable(int excepts);
+static void _sig_fptrap_restore(void);
+static void _sig_buffers_release(void);
+static size_t _sig_mem_shrink(size_t n);
 static void sigdie(int sig, const char* s);
+static void _sig_trace_event(int kind, int sig);
 
 #define BACKTRACELEN 1024
 static void print_backtrace(void);
 
+/* Set an atomic int to zero and return its old value */
+static inline int cy_atomic_clear(cy_atomic_int* p)
+{
+#if CYSIGNALS_C_ATOMIC
+    return atomic_exchange(p, 0);
+#else
+    int old = *p;
+    *p = 0;
+    return old;
+#endif
+}
+
 /* Implemented in signals.pyx */
 static int sig_raise_exception(int sig, const char* msg);
+static int _sig_raise_exception(int sig, const char* msg);
 
 
 /* Do whatever is needed to reset the CPU to a sane state after
@@ -196,6 +259,20 @@ static inline void print_stderr_ptr(void *ptr)
     }
 }
 
+/* Called by the signal handlers just before jumping back to sig_on().
+ * From this point, we are outside sig_on(): interrupts arriving while
+ * the exception is raised are stored in cysigs.interrupt_received and
+ * handled later, like interrupts outside sig_on(). This replaces
+ * blocking interrupts until _sig_on_recover(), so the recovery does
+ * not need any system call to change the signal mask. Any interrupt
+ * which was pending before is superseded by the signal we handle. */
+static inline void sig_leave_for_jump(void)
+{
+    cysigs.sig_on_count = 0;
+    cysigs.interrupt_received = 0;
+    custom_set_pending_signal(0);
+}
+
 /* Reset all signal handlers and the signal mask to their defaults. */
 static inline void sig_reset_defaults(void) {
 #ifdef SIGHUP
@@ -214,6 +291,9 @@ static inline void sig_reset_defaults(void) {
     signal(SIGSEGV, SIG_DFL);
 #ifdef SIGALRM
     signal(SIGALRM, SIG_DFL);
+#endif
+#ifdef SIGVTALRM
+    signal(SIGVTALRM, SIG_DFL);
 #endif
     signal(SIGTERM, SIG_DFL);
 #if HAVE_SIGPROCMASK
@@ -365,14 +445,550 @@ void get_monotonic_time(struct timespec *ts) {
 #endif
 }
 
+
+/* Trace log of signal-related events, see trace.pyx
+ *
+ * The log is a preallocated ring buffer which keeps the most recent
+ * events: when it is full, the oldest events are overwritten. Every
+ * slot has a sequence number which is zero while the slot is being
+ * written, such that a reader can detect (and skip) slots which are
+ * being overwritten concurrently. Recording an event only uses
+ * atomics, clock_gettime() and gettid(), so it is async-signal-safe.
+ *
+ * The buffer and its size are published together with one atomic
+ * store of sig_trace_log. A signal handler on another thread may still
+ * be writing to a buffer after sig_trace_stop(), so a buffer is never
+ * freed once published: when a larger one is needed, the old one is
+ * kept on the retired list. Since the size at least doubles every
+ * time, this wastes less memory than the current buffer. */
+#if CYSIGNALS_C_ATOMIC && !_WIN32
+#define SIG_TRACE_SUPPORTED 1
+#else
+#define SIG_TRACE_SUPPORTED 0
+#endif
+
+#if SIG_TRACE_SUPPORTED
+typedef struct
+{
+    _Atomic unsigned long seq;
+    sig_trace_event_t event;
+} sig_trace_slot_t;
+
+typedef struct sig_trace_log
+{
+    /* The number of slots minus 1 (a power of 2 minus 1) */
+    unsigned long mask;
+    /* The previous, smaller buffer (never freed) */
+    struct sig_trace_log* retired;
+    sig_trace_slot_t slots[];
+} sig_trace_log_t;
+
+static sig_trace_log_t* _Atomic sig_trace_log;
+static _Atomic unsigned long sig_trace_pos;
+
+static inline unsigned long sig_trace_thread_id(void)
+{
+#if defined(__linux__) && defined(SYS_gettid)
+    return (unsigned long)syscall(SYS_gettid);
+#else
+    return (unsigned long)pthread_self();
+#endif
+}
+#endif
+
+/* Record an event in the trace log. This must only be called when
+ * cysigs.trace_enabled is set. */
+static void _sig_trace_event(int kind, int sig)
+{
+#if SIG_TRACE_SUPPORTED
+    int saved_errno = errno;
+    struct timespec ts;
+    sig_trace_log_t* log = atomic_load_explicit(&sig_trace_log, memory_order_acquire);
+    if (!log) return;
+    unsigned long pos = atomic_fetch_add_explicit(&sig_trace_pos, 1, memory_order_relaxed);
+    sig_trace_slot_t* slot = &log->slots[pos & log->mask];
+
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    get_monotonic_time(&ts);
+    slot->event.time = (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    slot->event.thread = sig_trace_thread_id();
+    slot->event.kind = kind;
+    slot->event.sig = sig;
+    slot->event.file = cysigs.sig_on_file;
+    slot->event.line = cysigs.sig_on_line;
+
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    errno = saved_errno;
+#endif
+}
+
+#define sig_trace(kind, sig) \
+    do { if (cysigs.trace_enabled) _sig_trace_event(kind, sig); } while (0)
+
+/* Clear the trace log and start recording events, keeping at least the
+ * last ``capacity`` events. Return 0 on success or -1 with errno set. */
+static int sig_trace_start(size_t capacity)
+{
+#if SIG_TRACE_SUPPORTED
+    unsigned long size = 1, i;
+
+    if (cysigs.trace_enabled) {errno = EBUSY; return -1;}
+    if (capacity == 0 || capacity > (ULONG_MAX >> 2) / sizeof(sig_trace_slot_t))
+        {errno = EINVAL; return -1;}
+    while (size < capacity) size <<= 1;
+
+    /* Reuse the current buffer if it is large enough (never shrink it) */
+    sig_trace_log_t* log = atomic_load(&sig_trace_log);
+    if (!log || size > log->mask + 1)
+    {
+        sig_trace_log_t* newlog = malloc(sizeof(sig_trace_log_t) + size * sizeof(sig_trace_slot_t));
+        if (!newlog) {errno = ENOMEM; return -1;}
+        newlog->mask = size - 1;
+        newlog->retired = log;
+        for (i = 0; i < size; i++)
+            atomic_init(&newlog->slots[i].seq, 0);
+        atomic_store(&sig_trace_pos, 0);
+        atomic_store_explicit(&sig_trace_log, newlog, memory_order_release);
+    }
+    else
+    {
+        for (i = 0; i <= log->mask; i++)
+            atomic_store(&log->slots[i].seq, 0);
+        atomic_store(&sig_trace_pos, 0);
+    }
+    cysigs.trace_enabled = 1;
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* Stop recording events. The trace log is kept. */
+static void sig_trace_stop(void)
+{
+    cysigs.trace_enabled = 0;
+}
+
+/* Copy the most recent events from the trace log (at most n) to out,
+ * oldest first. Return the number of events copied. */
+static size_t sig_trace_read(sig_trace_event_t* out, size_t n)
+{
+    size_t count = 0;
+#if SIG_TRACE_SUPPORTED
+    sig_trace_log_t* log = atomic_load_explicit(&sig_trace_log, memory_order_acquire);
+    if (!log) return 0;
+
+    unsigned long end = atomic_load(&sig_trace_pos);
+    unsigned long start = 0, pos;
+    if (end > log->mask + 1) start = end - (log->mask + 1);
+    if (end - start > n) start = end - n;
+
+    for (pos = start; pos != end; pos++)
+    {
+        sig_trace_slot_t* slot = &log->slots[pos & log->mask];
+        unsigned long seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq != pos + 1) continue;  /* Overwritten or unfinished */
+        out[count] = slot->event;
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq) continue;
+        count++;
+    }
+#endif
+    return count;
+}
+
+
+/* The size of an allocated block, needed for memory budgets and
+ * allocation statistics. This is 0 if CYSIGNALS_HAVE_MEM_SIZE is 0. */
+static size_t _sig_mem_size(void* ptr)
+{
+#if HAVE_MALLOC_USABLE_SIZE
+    return malloc_usable_size(ptr);
+#elif HAVE_MALLOC_SIZE
+    return malloc_size(ptr);
+#elif defined(_WIN32)
+    return _msize(ptr);
+#else
+    return 0;
+#endif
+}
+
+
+/* Allocation statistics, see alloc_stats() in memory.pyx
+ *
+ * Every thread has its own table of call sites and histogram of size
+ * classes, which only that thread writes to. Therefore, the counters
+ * are updated with relaxed atomic loads and stores instead of the more
+ * expensive atomic read-modify-write operations. Readers may see
+ * slightly outdated values. The tables of all threads are kept in a
+ * linked list and are never freed. Only the number of live bytes (and
+ * its maximum) is shared between threads. */
+#if CYSIGNALS_C_ATOMIC && defined(__GNUC__)
+#define SIG_ALLOC_STATS_SUPPORTED 1
+#else
+#define SIG_ALLOC_STATS_SUPPORTED 0
+#endif
+
+#if SIG_ALLOC_STATS_SUPPORTED
+/* Size of the call site table of every thread (a power of 2) and the
+ * maximal number of probes in that hash table */
+#define ALLOC_STATS_SITES 1024
+#define ALLOC_STATS_PROBES 16
+
+typedef struct
+{
+    void* _Atomic site;
+    _Atomic unsigned long count;
+    _Atomic unsigned long long bytes;
+} alloc_stats_site_t;
+
+typedef struct alloc_stats_thread
+{
+    struct alloc_stats_thread* next;
+    alloc_stats_site_t sites[ALLOC_STATS_SITES];
+    /* Call sites which did not fit in the table */
+    alloc_stats_site_t other;
+    _Atomic unsigned long histogram[SIG_ALLOC_CLASSES];
+    _Atomic unsigned long frees;
+} alloc_stats_thread_t;
+
+static _Thread_local alloc_stats_thread_t* alloc_stats_current;
+static alloc_stats_thread_t* _Atomic alloc_stats_threads;
+static _Atomic long long alloc_stats_live;
+static _Atomic long long alloc_stats_peak;
+
+/* Add n to a counter only written by the current thread */
+#define alloc_stats_add(counter, n) atomic_store_explicit(&(counter), \
+        atomic_load_explicit(&(counter), memory_order_relaxed) + (n), \
+        memory_order_relaxed)
+
+static alloc_stats_thread_t* alloc_stats_thread(void)
+{
+    alloc_stats_thread_t* t = alloc_stats_current;
+    if (t) return t;
+
+    t = calloc(1, sizeof(alloc_stats_thread_t));
+    if (!t) return NULL;
+    t->next = atomic_load(&alloc_stats_threads);
+    while (!atomic_compare_exchange_weak(&alloc_stats_threads, &t->next, t));
+    alloc_stats_current = t;
+    return t;
+}
+
+static inline int alloc_size_class(size_t n)
+{
+    return n ? (int)(8 * sizeof(unsigned long long)) - __builtin_clzll((unsigned long long)n) : 0;
+}
+
+static alloc_stats_site_t* alloc_stats_find_site(alloc_stats_thread_t* t, void* site)
+{
+    size_t h = ((uintptr_t)site >> 2) * 2654435761u;
+    for (int i = 0; i < ALLOC_STATS_PROBES; i++)
+    {
+        alloc_stats_site_t* entry = &t->sites[(h + i) & (ALLOC_STATS_SITES - 1)];
+        void* key = atomic_load_explicit(&entry->site, memory_order_relaxed);
+        if (key == site) return entry;
+        if (key == NULL)
+        {
+            atomic_store_explicit(&entry->site, site, memory_order_release);
+            return entry;
+        }
+    }
+    return &t->other;
+}
+#endif
+
+/* Record the allocation of a block ptr of n bytes by the caller of
+ * this function. If the block replaces a block of old bytes (in
+ * realloc()), old is the size of that block as returned by
+ * _sig_mem_size(). Nothing is recorded if ptr is NULL. */
+static void _sig_alloc_stats_alloc(void* ptr, size_t n, size_t old)
+{
+#if SIG_ALLOC_STATS_SUPPORTED
+    if (!ptr) return;
+    alloc_stats_thread_t* t = alloc_stats_thread();
+    if (!t) return;
+
+    alloc_stats_site_t* entry = alloc_stats_find_site(t, __builtin_return_address(0));
+    alloc_stats_add(entry->count, 1);
+    alloc_stats_add(entry->bytes, n);
+    alloc_stats_add(t->histogram[alloc_size_class(n)], 1);
+
+    long long delta = (long long)_sig_mem_size(ptr) - (long long)old;
+    long long live = atomic_fetch_add_explicit(&alloc_stats_live, delta, memory_order_relaxed) + delta;
+    long long peak = atomic_load_explicit(&alloc_stats_peak, memory_order_relaxed);
+    while (live > peak && !atomic_compare_exchange_weak_explicit(&alloc_stats_peak,
+                &peak, live, memory_order_relaxed, memory_order_relaxed));
+#endif
+}
+
+/* Record freeing a block of the given size (from _sig_mem_size()) */
+static void _sig_alloc_stats_free(size_t size)
+{
+#if SIG_ALLOC_STATS_SUPPORTED
+    alloc_stats_thread_t* t = alloc_stats_thread();
+    if (t) alloc_stats_add(t->frees, 1);
+    atomic_fetch_sub_explicit(&alloc_stats_live, (long long)size, memory_order_relaxed);
+#endif
+}
+
+/* Copy the call sites of all threads with a nonzero count to out,
+ * storing at most n entries. The same call site may appear multiple
+ * times (for different threads). Return the total number of entries,
+ * which is more than n if out is too small. */
+static size_t _sig_alloc_stats_sites(sig_alloc_site_t* out, size_t n)
+{
+    size_t count = 0;
+#if SIG_ALLOC_STATS_SUPPORTED
+    alloc_stats_thread_t* t;
+    for (t = atomic_load(&alloc_stats_threads); t; t = t->next)
+    {
+        for (int i = 0; i <= ALLOC_STATS_SITES; i++)
+        {
+            alloc_stats_site_t* entry = (i < ALLOC_STATS_SITES) ? &t->sites[i] : &t->other;
+            unsigned long c = atomic_load_explicit(&entry->count, memory_order_relaxed);
+            if (!c) continue;
+            if (count < n)
+            {
+                out[count].site = (i < ALLOC_STATS_SITES) ?
+                    atomic_load_explicit(&entry->site, memory_order_acquire) : NULL;
+                out[count].count = c;
+                out[count].bytes = atomic_load_explicit(&entry->bytes, memory_order_relaxed);
+            }
+            count++;
+        }
+    }
+#endif
+    return count;
+}
+
+/* Compute the totals over all threads */
+static void _sig_alloc_stats_totals(sig_alloc_totals_t* out)
+{
+    memset(out, 0, sizeof(*out));
+#if SIG_ALLOC_STATS_SUPPORTED
+    alloc_stats_thread_t* t;
+    for (t = atomic_load(&alloc_stats_threads); t; t = t->next)
+    {
+        for (int k = 0; k < SIG_ALLOC_CLASSES; k++)
+            out->histogram[k] += atomic_load_explicit(&t->histogram[k], memory_order_relaxed);
+        out->frees += atomic_load_explicit(&t->frees, memory_order_relaxed);
+    }
+    out->live = atomic_load(&alloc_stats_live);
+    out->peak = atomic_load(&alloc_stats_peak);
+#endif
+}
+
+/* Reset all counters except the number of live bytes and set the peak
+ * to the current number of live bytes. Allocations happening at the
+ * same time in other threads may or may not be counted. */
+static void _sig_alloc_stats_reset(void)
+{
+#if SIG_ALLOC_STATS_SUPPORTED
+    alloc_stats_thread_t* t;
+    for (t = atomic_load(&alloc_stats_threads); t; t = t->next)
+    {
+        for (int i = 0; i <= ALLOC_STATS_SITES; i++)
+        {
+            alloc_stats_site_t* entry = (i < ALLOC_STATS_SITES) ? &t->sites[i] : &t->other;
+            atomic_store_explicit(&entry->count, 0, memory_order_relaxed);
+            atomic_store_explicit(&entry->bytes, 0, memory_order_relaxed);
+        }
+        for (int k = 0; k < SIG_ALLOC_CLASSES; k++)
+            atomic_store_explicit(&t->histogram[k], 0, memory_order_relaxed);
+        atomic_store_explicit(&t->frees, 0, memory_order_relaxed);
+    }
+    atomic_store(&alloc_stats_peak, atomic_load(&alloc_stats_live));
+#endif
+}
+
+
+/* Shrink callbacks
+ *
+ * When an allocation with one of the check_ functions from memory.pxd
+ * fails, _sig_mem_shrink() calls the registered shrink callbacks (for
+ * example functions evicting entries of a cache) before the allocation
+ * is tried again. The callbacks are called without holding the lock,
+ * so they may allocate memory or (un)register callbacks, and with
+ * interrupts blocked by sig_block(). sig_remove_shrinker() waits for
+ * calls of the callback in other threads, such that its argument can
+ * be freed afterwards. */
+#define SIG_SHRINK_MAX 32
+
+typedef size_t (*sig_shrink_t)(size_t n, void* arg);
+
+static struct
+{
+    sig_shrink_t fn;     /* NULL if the entry is unused */
+    void* arg;
+    int calls;           /* Number of calls in progress */
+} sig_shrinkers[SIG_SHRINK_MAX];
+
+#if !_WIN32
+static pthread_mutex_t sig_shrink_lock = PTHREAD_MUTEX_INITIALIZER;
+#define sig_shrink_acquire() pthread_mutex_lock(&sig_shrink_lock)
+#define sig_shrink_release() pthread_mutex_unlock(&sig_shrink_lock)
+#else
+#define sig_shrink_acquire()
+#define sig_shrink_release()
+#endif
+
+/* Number of calls of each callback in progress in the current thread */
+#if defined(__GNUC__)
+static __thread int sig_shrink_mine[SIG_SHRINK_MAX];
+#else
+static int sig_shrink_mine[SIG_SHRINK_MAX];
+#endif
+
+/* Register fn(n, arg) as shrink callback. It is called when allocating
+ * n bytes failed and should free memory, returning the number of bytes
+ * freed (0 if it cannot free anything). Return 0 on success, -1 with
+ * errno set if too many callbacks are registered. */
+static int sig_add_shrinker(sig_shrink_t fn, void* arg)
+{
+    int i;
+    sig_shrink_acquire();
+    for (i = 0; i < SIG_SHRINK_MAX; i++)
+    {
+        if (sig_shrinkers[i].fn == NULL && sig_shrinkers[i].calls == 0)
+        {
+            sig_shrinkers[i].fn = fn;
+            sig_shrinkers[i].arg = arg;
+            sig_shrink_release();
+            return 0;
+        }
+    }
+    sig_shrink_release();
+    errno = ENOSPC;
+    return -1;
+}
+
+/* Unregister a shrink callback registered with the same fn and arg,
+ * then wait until it is no longer called by other threads. This must
+ * not be called with a lock held which the callback takes (such as
+ * the Python GIL). */
+static void sig_remove_shrinker(sig_shrink_t fn, void* arg)
+{
+    int i;
+    sig_shrink_acquire();
+    for (i = 0; i < SIG_SHRINK_MAX; i++)
+    {
+        if (sig_shrinkers[i].fn == fn && sig_shrinkers[i].arg == arg)
+        {
+            sig_shrinkers[i].fn = NULL;
+            sig_shrinkers[i].arg = NULL;
+#if !_WIN32
+            while (sig_shrinkers[i].calls > sig_shrink_mine[i])
+            {
+                sig_shrink_release();
+                sched_yield();
+                sig_shrink_acquire();
+            }
+#endif
+            break;
+        }
+    }
+    sig_shrink_release();
+}
+
+
+/* Is the current thread the one which called the outermost sig_on()?
+ * Only that thread can jump back to sig_on(). */
+static inline int sig_on_owner(void)
+{
+#if !_WIN32
+    return pthread_equal(pthread_self(), cysigs.owner);
+#else
+    return 1;
+#endif
+}
+
+/* Buffers owned by sig_on()
+ *
+ * The heap storage of a sig_buffer from memory.pxd which was
+ * initialized inside sig_on() is registered here. If the outermost
+ * sig_on() block is left because of an exception or restarted by
+ * sig_retry(), the registered storage is freed by
+ * _sig_buffers_release(). The outermost sig_off() forgets all
+ * registrations with _sig_buffers_forget(). Every registration has a
+ * unique token, such that a buffer which was forgotten cannot change a
+ * later registration using the same slot. The table is only used by
+ * the thread owning the sig_on() block, with interrupts blocked. */
+#define SIG_BUFFER_MAX 64
+
+static struct
+{
+    void* ptr;
+    unsigned long long token;   /* 0 if the entry is unused */
+    int stats;                  /* Counted by the allocation statistics */
+} sig_buffers[SIG_BUFFER_MAX];
+
+static unsigned long long sig_buffer_last_token;
+
+/* Register ptr as storage to be freed if the sig_on() block with the
+ * given serial number is interrupted. stats is nonzero if ptr was
+ * counted by the allocation statistics (by a module compiled with
+ * CYSIGNALS_ALLOC_STATS). Return the slot and store the token in
+ * *token, or return -1 if this thread is not inside that sig_on()
+ * block or the table is full. */
+static int _sig_buffer_register(void* ptr, unsigned long serial, int stats, unsigned long long* token)
+{
+    int i;
+    if (cysigs.sig_on_count <= 0 || serial != cysigs.sig_on_serial || !sig_on_owner())
+        return -1;
+    for (i = 0; i < SIG_BUFFER_MAX; i++)
+    {
+        if (sig_buffers[i].token == 0)
+        {
+            sig_buffers[i].ptr = ptr;
+            sig_buffers[i].stats = stats;
+            sig_buffers[i].token = *token = ++sig_buffer_last_token;
+            cysigs.buffer_count++;
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* The registered storage was reallocated to ptr */
+static void _sig_buffer_update(int slot, unsigned long long token, void* ptr)
+{
+    if (slot >= 0 && sig_buffers[slot].token == token)
+        sig_buffers[slot].ptr = ptr;
+}
+
+/* The registered storage was freed or moved out */
+static void _sig_buffer_unregister(int slot, unsigned long long token)
+{
+    if (slot >= 0 && sig_buffers[slot].token == token)
+    {
+        sig_buffers[slot].ptr = NULL;
+        sig_buffers[slot].token = 0;
+        cysigs.buffer_count--;
+    }
+}
+
+/* Forget all registrations (called by the outermost sig_off()) */
+static void _sig_buffers_forget(void)
+{
+    memset(sig_buffers, 0, sizeof(sig_buffers));
+    cysigs.buffer_count = 0;
+}
+
 /* Handler for SIGHUP, SIGINT, SIGALRM, SIGTERM
  *
  * Inside sig_on() (i.e. when cysigs.sig_on_count is positive), this
- * raises an exception and jumps back to sig_on().
+ * raises an exception and jumps back to sig_on(). If the signal was
+ * delivered to another thread, it is first forwarded to the thread
+ * which called sig_on().
  * Outside of sig_on(), we set Python's interrupt flag using
  * PyErr_SetInterrupt() */
 static void cysigs_interrupt_handler(int sig)
 {
+    cysignals_probe2(interrupt_handler, sig, (int)cysigs.sig_on_count);
 #if ENABLE_DEBUG_CYSIGNALS
     if (cysigs.debug_level >= 1) {
         print_stderr("\n*** SIG ");
@@ -387,6 +1003,19 @@ static void cysigs_interrupt_handler(int sig)
         if (!cysigs.interrupt_received) get_monotonic_time(&sigtime);
     }
 #endif
+#if !_WIN32
+    if (cysigs.sig_on_count > 0 && !sig_on_owner())
+    {
+        /* The signal was delivered to some other thread: forward it to
+         * the thread inside sig_on(), which may be running in another
+         * (sub)interpreter. */
+        int saved_errno = errno;
+        pthread_kill(cysigs.owner, sig);
+        errno = saved_errno;
+        return;
+    }
+#endif
+    sig_trace(SIG_TRACE_SIGNAL, sig);
 
     if (cysigs.sig_on_count > 0)
     {
@@ -396,6 +1025,8 @@ static void cysigs_interrupt_handler(int sig)
              * The signal number is encoded in the return value of sigsetjmp.
              * Do NOT call Python code from signal handler! */
 #if !_WIN32
+            sig_trace(SIG_TRACE_LONGJMP, sig);
+            sig_leave_for_jump();
             siglongjmp(trampoline, sig);
 #endif
         }
@@ -411,6 +1042,7 @@ static void cysigs_interrupt_handler(int sig)
     /* If we are here, we cannot handle the interrupt immediately, so
      * we store the signal number for later use.  But make sure we
      * don't overwrite a SIGHUP or SIGTERM which we already received. */
+    sig_trace(SIG_TRACE_DEFER, sig);
     if (
 #ifdef SIGHUP
         cysigs.interrupt_received != SIGHUP && 
@@ -420,19 +1052,50 @@ static void cysigs_interrupt_handler(int sig)
         cysigs.interrupt_received = sig;
         custom_set_pending_signal(sig);
     }
+
+#if !_WIN32
+    int fd = sig_wake_fd;
+    if (fd >= 0)
+    {
+        int saved_errno = errno;
+        char c = (char)sig;
+        if (write(fd, &c, 1)) {}
+        errno = saved_errno;
+    }
+#endif
+}
+
+/* Called by the handler for SIGVTALRM of cpu_alarm() (see
+ * alarm_helper.c) in the thread whose CPU-time alarm expired. Handle
+ * the interrupt sig as cysigs_interrupt_handler() if it can be raised
+ * in this thread: inside sig_on() if this thread called sig_on(), or
+ * outside sig_on() if this is the main thread (main_thread nonzero),
+ * where the Python-level interrupt handler runs. Otherwise, return 0
+ * without handling it, in particular without forwarding it to the
+ * thread inside sig_on(). */
+static int _sig_interrupt_thread(int sig, int main_thread)
+{
+#if !_WIN32
+    if (cysigs.sig_on_count > 0 ? !sig_on_owner() : !main_thread)
+        return 0;
+#endif
+    cysigs_interrupt_handler(sig);
+    return 1;
 }
 
 /* Handler for SIGQUIT, SIGILL, SIGABRT, SIGFPE, SIGBUS, SIGSEGV
  *
- * Inside sig_on() (i.e. when cysigs.sig_on_count is positive), this
- * raises an exception and jumps back to sig_on().
- * Outside of sig_on(), we terminate Python. */
+ * Inside sig_on() (i.e. when cysigs.sig_on_count is positive) in the
+ * thread which called sig_on(), this raises an exception and jumps
+ * back to sig_on(). Otherwise, we terminate Python. */
 static void cysigs_signal_handler(int sig)
 {
     int inside = cysigs.inside_signal_handler;
     cysigs.inside_signal_handler = 1;
+    cysignals_probe2(signal_handler, sig, inside);
+    sig_trace(SIG_TRACE_SIGNAL, sig);
 
-    if (inside == 0 && cysigs.sig_on_count > 0 
+    if (inside == 0 && cysigs.sig_on_count > 0 && sig_on_owner()
         #ifdef SIGQUIT
             && sig != SIGQUIT
         #endif
@@ -452,6 +1115,8 @@ static void cysigs_signal_handler(int sig)
          * The signal number is encoded in the return value of sigsetjmp.
          * Do NOT call Python code from signal handler! */
     #if !_WIN32
+        sig_trace(SIG_TRACE_LONGJMP, sig);
+        sig_leave_for_jump();
         siglongjmp(trampoline, sig);
     #endif
     }
@@ -465,58 +1130,576 @@ static void cysigs_signal_handler(int sig)
     }
 }
 
-#if !_WIN32
-/* A trampoline to jump to after handling a signal.
- *
- * The jump to sig_on() uses cylongjmp(), which does not restore the
- * signal context. This is done for efficiency, as cysetjmp() is
- * significantly faster this way. But in order to get away from our alt
- * stack after handling a signal, we need an additional siglongjmp()
- * call to restore the signal context. This is the call from the signal
- * handler to this trampoline function.
- *
- * Setting this up requires some trickery:
- * (A) create a separate stack for this trampoline function
- * (B) start a new thread using this stack
- * (C) set a jump point on the trampoline stack using cysetjmp()
- * (D) exit the thread
- * (E) back in the main thread, jump to the point set at (C). Now we are
- *     on the trampoline stack
- * (F) set a jump point with savesigs=1. This is where we will jump to
- *     after handling a signal
- * (G) jump back to the main program
+/* Dedicated stacks for sig_call_on_stack()
  *
- * NOTE: it may look strange to use threads for this, but there are not
- * a lot of good ways to get code running on an arbitrary stack. In
- * fact, POSIX recommends threads in
- * http://pubs.opengroup.org/onlinepubs/009695299/functions/makecontext.html
- */
-static void* _sig_on_trampoline(CYTHON_UNUSED void* dummy)
-{
-    register int sig;
+ * A dedicated stack is an anonymous mapping: the lowest
+ * SIG_STACK_GUARD bytes are inaccessible, the rest is only committed
+ * when it is used. A fault in the guard area while running on the
+ * dedicated stack is a stack overflow: the signal handler (running on
+ * the alternate signal stack) sets sig_stack.overflow and jumps back
+ * to sig_on() as for any SIGSEGV, and sig_raise_exception() turns it
+ * into a RecursionError. */
+#if !_WIN32 && HAVE_SYS_MMAN_H && defined(MAP_ANON)
+#define SIG_STACK_SUPPORTED 1
+#else
+#define SIG_STACK_SUPPORTED 0
+#endif
 
-    /* Reserve some unused stack space to prevent pthread_exit() from
-     * clobbering the stack that we care about. This is in particular
-     * needed on certain older GNU/Linux systems:
-     * https://trac.sagemath.org/ticket/25092#comment:6 */
-    char stack_guard[2048];
+#define SIG_STACK_GUARD (1 << 16)
 
-    if (cysetjmp(trampoline_setup) == 0)
-        /* The argument to pthread_exit() does not matter. We use
-         * stack_guard to prevent GCC from optimizing away the
-         * stack_guard variable. */
-        pthread_exit(stack_guard);
+static struct
+{
+    char* base;          /* Start of the mapping (the guard area) */
+    size_t size;         /* Size of the mapping */
+    volatile int running;   /* Running on the dedicated stack */
+    volatile int overflow;  /* A stack overflow occurred */
+    void (*fn)(void*);
+    void* arg;
+#if !_WIN32
+    cyjmp_buf entry;     /* Jump point on the dedicated stack */
+    cyjmp_buf ret;       /* Jump point back on the caller's stack */
+#endif
+} sig_stack;
 
-    sig = sigsetjmp(trampoline, 1);
-    reset_CPU();
-    cylongjmp(cysigs.env, sig);
+/* Unmap the dedicated stack. This must not be called while running on
+ * it. This is also called by _sig_on_recover() when the stack was left
+ * because of an exception. */
+static void _sig_stack_release(void)
+{
+#if SIG_STACK_SUPPORTED
+    if (sig_stack.base)
+    {
+        munmap(sig_stack.base, sig_stack.size);
+        sig_stack.base = NULL;
+    }
+#endif
+    sig_stack.running = 0;
 }
 
+/* Return 1 and clear the flag if the last SIGSEGV was a stack overflow
+ * on the dedicated stack */
+static int _sig_stack_overflowed(void)
+{
+    int ret = sig_stack.overflow;
+    sig_stack.overflow = 0;
+    return ret;
+}
 
-static void setup_trampoline(void)
+#if !_WIN32
+/* The si_code of the last SIGFPE, used to report which floating-point
+ * exception was trapped. The floating-point flags cannot be used for
+ * this: the kernel clears them when calling the signal handler. */
+static int sig_fpe_code;
+
+/* Handler for SIGFPE: save the si_code, then continue as
+ * cysigs_signal_handler() */
+static void cysigs_fpe_handler(int sig, siginfo_t* info, CYTHON_UNUSED void* context)
 {
-    int ret;
-    pthread_t child;
+    sig_fpe_code = info->si_code;
+    cysigs_signal_handler(sig);
+}
+#endif
+
+/* Guarded mappings
+ *
+ * A fault (SIGBUS or SIGSEGV) inside sig_on() at an address inside a
+ * registered range raises OSError with the file name and the offset in
+ * the file instead of SignalError. This is meant for memory-mapped
+ * files, where accessing a page beyond the end of a file which was
+ * truncated raises SIGBUS. The table is modified with sig_guard_lock
+ * held, the signal handler only reads it. */
+#define SIG_GUARD_MAX 64
+
+#if !_WIN32
+/* Number of fault handlers currently reading the tables of guarded
+ * mappings and lazy regions. Removing an entry first clears its start,
+ * such that no new fault handler finds it, then waits in
+ * sig_fault_quiesce() until this is zero before freeing what the entry
+ * points to. */
+static cy_atomic_int sig_fault_readers;
+
+static void sig_fault_quiesce(void)
+{
+#if CYSIGNALS_C_ATOMIC
+    atomic_thread_fence(memory_order_seq_cst);
+#elif defined(__GNUC__)
+    __sync_synchronize();
+#endif
+    while (sig_fault_readers) sched_yield();
+}
+#endif
+
+static struct
+{
+    const char* volatile start;  /* NULL if the entry is unused */
+    size_t len;
+    long long offset;            /* Offset in the file of start */
+    char* name;                  /* File name, owned by the entry */
+} sig_guards[SIG_GUARD_MAX];
+
+/* The last fault in a guarded mapping. name is NULL if there is none. */
+static struct
+{
+    const char* volatile name;
+    long long offset;
+} sig_fault;
+
+#if !_WIN32
+static pthread_mutex_t sig_guard_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Register the range [addr, addr + len) as a mapping of the file
+ * ``name`` starting at ``offset``. Return 0 on success, -1 with errno
+ * set on failure. */
+static int sig_guard_mapping(const void* addr, size_t len, const char* name, long long offset)
+{
+    char* s = strdup(name);
+    if (s == NULL) return -1;
+
+    int i;
+    pthread_mutex_lock(&sig_guard_lock);
+    for (i = 0; i < SIG_GUARD_MAX; i++)
+    {
+        if (sig_guards[i].start == NULL)
+        {
+            sig_guards[i].len = len;
+            sig_guards[i].offset = offset;
+            sig_guards[i].name = s;
+            sig_guards[i].start = (const char*)addr;
+            pthread_mutex_unlock(&sig_guard_lock);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&sig_guard_lock);
+    free(s);
+    errno = ENOSPC;
+    return -1;
+}
+
+/* Remove the mapping starting at addr from the guarded mappings. This
+ * waits for fault handlers which may still use the entry. */
+static void sig_unguard_mapping(const void* addr)
+{
+    int i;
+    pthread_mutex_lock(&sig_guard_lock);
+    for (i = 0; i < SIG_GUARD_MAX; i++)
+    {
+        if (sig_guards[i].start == (const char*)addr)
+        {
+            sig_guards[i].start = NULL;
+            sig_fault_quiesce();
+            if (sig_fault.name == sig_guards[i].name) sig_fault.name = NULL;
+            free(sig_guards[i].name);
+            sig_guards[i].name = NULL;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sig_guard_lock);
+}
+
+/* Called by the signal handler: remember the mapping containing addr */
+static void sig_guard_fault(const char* addr)
+{
+    int i;
+    sig_fault.name = NULL;
+    for (i = 0; i < SIG_GUARD_MAX; i++)
+    {
+        const char* start = sig_guards[i].start;
+        if (start != NULL && addr >= start && addr < start + sig_guards[i].len)
+        {
+            sig_fault.offset = sig_guards[i].offset + (addr - start);
+            sig_fault.name = sig_guards[i].name;
+            return;
+        }
+    }
+}
+#else
+static int sig_guard_mapping(CYTHON_UNUSED const void* addr, CYTHON_UNUSED size_t len,
+                             CYTHON_UNUSED const char* name, CYTHON_UNUSED long long offset)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+static void sig_unguard_mapping(CYTHON_UNUSED const void* addr) { }
+#endif
+
+/* If the last fault was in a guarded mapping, return the file name and
+ * store the offset in *offset. Otherwise, return NULL. This also
+ * forgets the fault. The name is valid until the mapping is removed. */
+static const char* _sig_fault_mapping(long long* offset)
+{
+    const char* name = sig_fault.name;
+    sig_fault.name = NULL;
+    *offset = sig_fault.offset;
+    return name;
+}
+
+/* Lazy regions
+ *
+ * A lazy region is a private mapping of an anonymous file (from
+ * memfd_create() or shm_open()), reserved with PROT_NONE. The same
+ * file is also mapped shared and writable at another address, the
+ * alias. The first access to a page faults and the signal handler
+ * calls the fill callback of the region to initialize the page through
+ * the alias. Only then it makes the page accessible and returns, such
+ * that the faulting instruction is restarted. Therefore, no thread can
+ * see a partially filled page. The state of every page (SIG_PAGE_*) is
+ * changed atomically, such that a page is filled only once when
+ * several threads fault on it; the other threads keep faulting until
+ * it is filled. The table is modified with sig_guard_lock held, the
+ * signal handler only reads it. */
+#if SIG_STACK_SUPPORTED && CYSIGNALS_C_ATOMIC && defined(__GNUC__) && (HAVE_MEMFD_CREATE || HAVE_SHM_OPEN)
+#define SIG_LAZY_SUPPORTED 1
+#else
+#define SIG_LAZY_SUPPORTED 0
+#endif
+
+#define SIG_LAZY_MAX 64
+
+#define SIG_PAGE_EMPTY    0
+#define SIG_PAGE_FILLING  1
+#define SIG_PAGE_FILLED   2
+
+typedef int (*sig_fill_t)(void* page, size_t offset, size_t len, void* arg);
+
+#if SIG_LAZY_SUPPORTED
+static struct
+{
+    char* volatile start;        /* NULL if the entry is unused */
+    size_t size;                 /* Size rounded up to whole pages */
+    sig_fill_t fill;
+    void* arg;
+    cy_atomic_int* pages;        /* State of each page */
+    char* alias;                 /* Where pages are filled */
+} sig_lazy[SIG_LAZY_MAX];
+
+static size_t sig_pagesize;
+
+/* The address of the last fault in this thread on a page which was
+ * already filled, see sig_lazy_fault() */
+static __thread char* sig_lazy_retried;
+
+/* Called by the signal handler: if addr is in a lazy region, fill the
+ * page containing it. Return 1 if the faulting access can be retried,
+ * 0 if this is a real fault. */
+static int sig_lazy_fault(char* addr)
+{
+    int i;
+    for (i = 0; i < SIG_LAZY_MAX; i++)
+    {
+        char* start = sig_lazy[i].start;
+        if (start == NULL || addr < start || addr >= start + sig_lazy[i].size)
+            continue;
+
+        size_t n = (size_t)(addr - start) / sig_pagesize;
+        char* page = start + n * sig_pagesize;
+        cy_atomic_int* state = &sig_lazy[i].pages[n];
+
+        int expected = SIG_PAGE_EMPTY;
+        if (!atomic_compare_exchange_strong(state, &expected, SIG_PAGE_FILLING))
+        {
+            /* Being filled by another thread: retry (faulting again
+             * until it is done) */
+            if (expected == SIG_PAGE_FILLING)
+            {
+                sig_lazy_retried = NULL;
+                return 1;
+            }
+            /* The page may have been filled after this fault happened,
+             * so retry once. Another fault at the same address is a
+             * real fault, for example a write to a page made
+             * read-only. */
+            if (sig_lazy_retried != addr)
+            {
+                sig_lazy_retried = addr;
+                return 1;
+            }
+            sig_lazy_retried = NULL;
+            return 0;
+        }
+
+        int saved_errno = errno;
+        int ok = (sig_lazy[i].fill(sig_lazy[i].alias + n * sig_pagesize,
+                                   n * sig_pagesize, sig_pagesize, sig_lazy[i].arg) == 0 &&
+                  mprotect(page, sig_pagesize, PROT_READ|PROT_WRITE) == 0);
+        if (!ok)
+        {
+            atomic_store(state, SIG_PAGE_EMPTY);
+            cysigs.s = "failed to fill a page of a lazy region";
+            cysigs.s_format = 0;
+        }
+        else
+        {
+            atomic_store(state, SIG_PAGE_FILLED);
+        }
+        errno = saved_errno;
+        return ok;
+    }
+    return 0;
+}
+
+/* Return a file descriptor of a new anonymous file of size bytes, or
+ * -1 with errno set on failure */
+static int sig_lazy_file(size_t size)
+{
+#if HAVE_MEMFD_CREATE
+    int fd = memfd_create("cysignals-lazy", MFD_CLOEXEC);
+#else
+    static cy_atomic_int counter;
+    char name[64];
+    snprintf(name, sizeof(name), "/cysignals-lazy-%ld-%d", (long)getpid(), (int)++counter);
+    int fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600);
+    if (fd >= 0) shm_unlink(name);
+#endif
+    if (fd < 0) return -1;
+    if (ftruncate(fd, (off_t)size) != 0)
+    {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+#endif
+
+/* Reserve a lazy region of size bytes: each page is filled by
+ * fill(page, offset, len, arg) when it is first accessed, where page
+ * points to the len bytes at offset in the region through the alias
+ * (not at their address in the region). The fill function is called from a signal handler, possibly on the small
+ * alternate signal stack, so it must be async-signal-safe and must
+ * not allocate or free lazy regions. It should return 0 on success;
+ * otherwise, the access is handled as a segmentation fault. Return NULL with a
+ * Python exception set on failure. */
+static void* sig_lazy_alloc(size_t size, sig_fill_t fill, void* arg)
+{
+    int err;
+#if SIG_LAZY_SUPPORTED
+    if (sig_pagesize == 0) sig_pagesize = (size_t)sysconf(_SC_PAGESIZE);
+    if (size == 0) size = 1;
+    size = (size + sig_pagesize - 1) / sig_pagesize * sig_pagesize;
+
+    cy_atomic_int* pages = calloc(size / sig_pagesize, sizeof(cy_atomic_int));
+    if (pages == NULL) {err = ENOMEM; goto fail;}
+    int fd = sig_lazy_file(size);
+    if (fd < 0) {err = errno; free((void*)pages); goto fail;}
+    void* start = mmap(NULL, size, PROT_NONE, MAP_PRIVATE, fd, 0);
+    void* alias = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    err = errno;
+    close(fd);
+    if (start == MAP_FAILED || alias == MAP_FAILED)
+    {
+        if (start != MAP_FAILED) munmap(start, size);
+        if (alias != MAP_FAILED) munmap(alias, size);
+        free((void*)pages);
+        goto fail;
+    }
+
+    int i;
+    pthread_mutex_lock(&sig_guard_lock);
+    for (i = 0; i < SIG_LAZY_MAX; i++)
+    {
+        if (sig_lazy[i].start == NULL)
+        {
+            sig_lazy[i].size = size;
+            sig_lazy[i].fill = fill;
+            sig_lazy[i].arg = arg;
+            sig_lazy[i].pages = pages;
+            sig_lazy[i].alias = (char*)alias;
+            sig_lazy[i].start = (char*)start;
+            pthread_mutex_unlock(&sig_guard_lock);
+            return start;
+        }
+    }
+    pthread_mutex_unlock(&sig_guard_lock);
+    munmap(start, size);
+    munmap(alias, size);
+    free((void*)pages);
+    err = ENOSPC;
+fail:
+#else
+    (void)size; (void)fill; (void)arg;
+    err = ENOSYS;
+#endif
+    {
+        PyGILState_STATE gilstate = PyGILState_Ensure();
+        errno = err;
+        PyErr_SetFromErrno(PyExc_OSError);
+        PyGILState_Release(gilstate);
+    }
+    return NULL;
+}
+
+/* Unmap a lazy region returned by sig_lazy_alloc(). This waits for
+ * fault handlers which may still use the region, so it must not be
+ * called from a fill function. */
+static void sig_lazy_free(void* ptr)
+{
+#if SIG_LAZY_SUPPORTED
+    int i;
+    pthread_mutex_lock(&sig_guard_lock);
+    for (i = 0; i < SIG_LAZY_MAX; i++)
+    {
+        if (sig_lazy[i].start == (char*)ptr)
+        {
+            sig_lazy[i].start = NULL;
+            sig_fault_quiesce();
+            munmap(ptr, sig_lazy[i].size);
+            munmap(sig_lazy[i].alias, sig_lazy[i].size);
+            free((void*)sig_lazy[i].pages);
+            sig_lazy[i].pages = NULL;
+            sig_lazy[i].alias = NULL;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sig_guard_lock);
+#endif
+}
+
+#if !_WIN32
+/* Handler for SIGSEGV and SIGBUS: fill pages of lazy regions, check
+ * for an overflow of the dedicated stack and for a guarded mapping,
+ * then continue as cysigs_signal_handler() */
+static void cysigs_fault_handler(int sig, siginfo_t* info, CYTHON_UNUSED void* context)
+{
+    char* addr = (char*)info->si_addr;
+    sig_fault_readers++;
+#if SIG_LAZY_SUPPORTED
+    if (sig_lazy_fault(addr)) {sig_fault_readers--; return;}
+#endif
+#if SIG_STACK_SUPPORTED
+    if (sig_stack.running && sig_stack.base &&
+            addr >= sig_stack.base && addr < sig_stack.base + SIG_STACK_GUARD)
+        sig_stack.overflow = 1;
+#endif
+    sig_guard_fault(addr);
+    sig_fault_readers--;
+    cysigs_signal_handler(sig);
+}
+#endif
+
+#if SIG_STACK_SUPPORTED
+
+/* Start routine of the thread used to set up the jump point on the
+ * dedicated stack, using the same trick as _sig_on_trampoline() */
+static void* _sig_stack_entry(CYTHON_UNUSED void* dummy)
+{
+    char stack_guard[2048];
+
+    if (cysetjmp(sig_stack.entry) == 0)
+        pthread_exit(stack_guard);
+
+    /* We are now running on the dedicated stack, in the thread which
+     * called sig_call_on_stack() */
+    sig_stack.fn(sig_stack.arg);
+    cylongjmp(sig_stack.ret, 1);
+    return NULL;
+}
+
+/* Map a dedicated stack of stack_size usable bytes and set up the
+ * jump point sig_stack.entry on it. Return 0 on success or set errno
+ * and return -1 on error. */
+static int _sig_stack_setup(size_t stack_size)
+{
+    int ret;
+    pthread_t child;
+    pthread_attr_t attr;
+    long pagesize = sysconf(_SC_PAGESIZE);
+    int flags = MAP_ANON|MAP_PRIVATE;
+#ifdef MAP_NORESERVE
+    flags |= MAP_NORESERVE;
+#endif
+#ifdef MAP_STACK
+    flags |= MAP_STACK;
+#endif
+
+#ifdef PTHREAD_STACK_MIN
+    if (stack_size < (size_t)PTHREAD_STACK_MIN)
+        stack_size = PTHREAD_STACK_MIN;
+#endif
+    if (stack_size > SIZE_MAX - SIG_STACK_GUARD - pagesize) {errno = ENOMEM; return -1;}
+    stack_size = ((stack_size - 1) | (pagesize - 1)) + 1;
+
+    void* base = mmap(NULL, stack_size + SIG_STACK_GUARD,
+                      PROT_READ|PROT_WRITE, flags, -1, 0);
+    if (base == MAP_FAILED) return -1;
+    if (mprotect(base, SIG_STACK_GUARD, PROT_NONE)) goto error;
+    sig_stack.base = (char*)base;
+    sig_stack.size = stack_size + SIG_STACK_GUARD;
+
+    ret = pthread_attr_init(&attr);
+    if (ret) {errno = ret; goto error;}
+    ret = pthread_attr_setstack(&attr, sig_stack.base + SIG_STACK_GUARD, stack_size);
+    if (!ret) ret = pthread_create(&child, &attr, _sig_stack_entry, NULL);
+    pthread_attr_destroy(&attr);
+    if (!ret) ret = pthread_join(child, NULL);
+    if (ret) {errno = ret; goto error;}
+    return 0;
+
+error:
+    ret = errno;
+    munmap(base, stack_size + SIG_STACK_GUARD);
+    sig_stack.base = NULL;
+    errno = ret;
+    return -1;
+}
+#endif
+
+
+#if !_WIN32
+/* A trampoline to jump to after handling a signal.
+ *
+ * The jump to sig_on() uses cylongjmp(), which does not restore the
+ * signal context. This is done for efficiency, as cysetjmp() is
+ * significantly faster this way. But in order to get away from our alt
+ * stack after handling a signal, we need an additional siglongjmp()
+ * call to restore the signal context. This is the call from the signal
+ * handler to this trampoline function.
+ *
+ * Setting this up requires some trickery:
+ * (A) create a separate stack for this trampoline function
+ * (B) start a new thread using this stack
+ * (C) set a jump point on the trampoline stack using cysetjmp()
+ * (D) exit the thread
+ * (E) back in the main thread, jump to the point set at (C). Now we are
+ *     on the trampoline stack
+ * (F) set a jump point with savesigs=1. This is where we will jump to
+ *     after handling a signal. The saved signal mask is the default
+ *     signal mask, so the siglongjmp() from the signal handler also
+ *     restores the signal mask.
+ * (G) jump back to the main program
+ *
+ * NOTE: it may look strange to use threads for this, but there are not
+ * a lot of good ways to get code running on an arbitrary stack. In
+ * fact, POSIX recommends threads in
+ * http://pubs.opengroup.org/onlinepubs/009695299/functions/makecontext.html
+ */
+static void* _sig_on_trampoline(CYTHON_UNUSED void* dummy)
+{
+    register int sig;
+
+    /* Reserve some unused stack space to prevent pthread_exit() from
+     * clobbering the stack that we care about. This is in particular
+     * needed on certain older GNU/Linux systems:
+     * https://trac.sagemath.org/ticket/25092#comment:6 */
+    char stack_guard[2048];
+
+    if (cysetjmp(trampoline_setup) == 0)
+        /* The argument to pthread_exit() does not matter. We use
+         * stack_guard to prevent GCC from optimizing away the
+         * stack_guard variable. */
+        pthread_exit(stack_guard);
+
+    sig = sigsetjmp(trampoline, 1);
+    reset_CPU();
+    cylongjmp(cysigs.env, sig);
+}
+
+
+static void setup_trampoline(void)
+{
+    int ret;
+    pthread_t child;
     pthread_attr_t attr;
     void* trampolinestack;
     size_t trampolinestacksize = 1 << 17;
@@ -552,6 +1735,76 @@ static void setup_trampoline(void)
 #endif
 
 
+/* Enable the floating-point exceptions ``excepts`` as traps until the
+ * end of the sig_on() region. The floating-point environment is saved
+ * when traps are first enabled in the region. */
+static void _sig_fptrap_enable(int excepts)
+{
+#if CYSIGNALS_HAVE_FPTRAP
+    if (!cysigs.fptrap_active)
+    {
+        fegetenv(&sig_fptrap_env);
+        cysigs.fptrap_active = 1;
+    }
+    feclearexcept(FE_ALL_EXCEPT);
+    feenableexcept(excepts & FE_ALL_EXCEPT);
+#endif
+}
+
+/* Restore the floating-point environment saved by _sig_fptrap_enable() */
+static void _sig_fptrap_restore(void)
+{
+#if CYSIGNALS_HAVE_FPTRAP
+    fesetenv(&sig_fptrap_env);
+#endif
+    cysigs.fptrap_active = 0;
+}
+
+/* Return a message for the trapped floating-point exception, or NULL
+ * if the SIGFPE was not caused by a trap (for example, an integer
+ * division by zero) */
+static const char* sig_fptrap_message(void)
+{
+#if CYSIGNALS_HAVE_FPTRAP
+    int code = sig_fpe_code;
+    sig_fpe_code = 0;
+    switch (code)
+    {
+        case FPE_FLTINV: return "invalid floating-point operation";
+        case FPE_FLTDIV: return "floating-point division by zero";
+        case FPE_FLTOVF: return "floating-point overflow";
+        case FPE_FLTUND: return "floating-point underflow";
+        case FPE_FLTRES: return "inexact floating-point result";
+    }
+#endif
+    return NULL;
+}
+
+
+/* Return nonzero if the format of sig_strf() is safe to pass to
+ * snprintf() with SIG_STRF_MAXARGS arguments of type long: it may only
+ * contain %% and at most SIG_STRF_MAXARGS conversions like %ld, %lu
+ * or %lx (with optional flags, width and precision). Other formats
+ * are used as message without formatting. */
+static int _sig_strf_valid(const char* format)
+{
+    const char* p = format;
+    int n = 0;
+    while ((p = strchr(p, '%')) != NULL)
+    {
+        p++;
+        if (*p == '%') {p++; continue;}
+        p += strspn(p, "-+ #0");
+        p += strspn(p, "0123456789");
+        if (*p == '.') {p++; p += strspn(p, "0123456789");}
+        if (p[0] != 'l' || p[1] == '\0' || !strchr("diouxX", p[1])) return 0;
+        p += 2;
+        if (++n > SIG_STRF_MAXARGS) return 0;
+    }
+    return 1;
+}
+
+
 /* This calls sig_raise_exception() to actually raise the exception. */
 static void _do_raise_exception(int sig)
 {
@@ -572,8 +1825,37 @@ static void _do_raise_exception(int sig)
     }
 #endif
 
-    /* Call Cython function to raise exception */
-    sig_raise_exception(sig, cysigs.s);
+    /* Call Cython function to raise exception. If this thread holds
+     * the GIL, raise it directly in its current thread state instead
+     * of acquiring the GIL again with PyGILState_Ensure(). */
+    sig_trace(SIG_TRACE_RAISE, sig);
+
+    /* Format the message of sig_strf() */
+    const char* msg = cysigs.s;
+    char buf[512];
+    if (msg != NULL && cysigs.s_format && _sig_strf_valid(msg))
+    {
+        snprintf(buf, sizeof(buf), msg, cysigs.s_args[0], cysigs.s_args[1],
+                 cysigs.s_args[2], cysigs.s_args[3]);
+        msg = buf;
+    }
+
+    /* Disable floating-point traps before running Python code, after
+     * checking which exception was trapped */
+    if (unlikely(cysigs.fptrap_active))
+    {
+        if (sig == SIGFPE && msg == NULL) msg = sig_fptrap_message();
+        _sig_fptrap_restore();
+    }
+
+#if PY_VERSION_HEX >= 0x030D0000
+    if (PyThreadState_GetUnchecked() != NULL)
+#else
+    if (_PyThreadState_UncheckedGet() != NULL)
+#endif
+        _sig_raise_exception(sig, msg);
+    else
+        sig_raise_exception(sig, msg);
 }
 
 
@@ -581,38 +1863,53 @@ static void _do_raise_exception(int sig)
  * received *before* the call to sig_on(). */
 static void _sig_on_interrupt_received(void)
 {
-#if HAVE_SIGPROCMASK
-    /* Momentarily block signals to avoid race conditions */
-    sigset_t oldset;
-    sigprocmask(SIG_BLOCK, &sigmask_with_sigint, &oldset);
-#endif
+    /* When called from sig_on(), this ends the sig_on() region */
+    if (cysigs.sig_on_count > 0) sig_trace(SIG_TRACE_RECOVER, 0);
 
-    _do_raise_exception(cysigs.interrupt_received);
+    /* First leave sig_on(), such that a new interrupt is stored in
+     * cysigs.interrupt_received instead of jumping. Then atomically
+     * take the pending interrupt: an interrupt arriving after this
+     * point will be handled later. */
     cysigs.sig_on_count = 0;
-    cysigs.interrupt_received = 0;
+    int sig = cy_atomic_clear(&cysigs.interrupt_received);
     custom_set_pending_signal(0);
 
-#if HAVE_SIGPROCMASK
-    sigprocmask(SIG_SETMASK, &oldset, NULL);
-#endif
+    _do_raise_exception(sig);
+}
+
+/* Handle a nonzero cancellation word, see sig_check(). The word is
+ * detached, such that the exception is raised only once. Inside
+ * sig_on(), this jumps back to sig_on() like an interrupt. If the
+ * cancellation cannot be handled now (inside sig_block() or in another
+ * thread than the one inside sig_on()), the word stays attached and 1
+ * is returned. Otherwise, the exception is raised and 0 is returned. */
+static int _sig_cancel(void)
+{
+    if (cysigs.sig_on_count > 0)
+    {
+        if (cysigs.block_sigint || custom_signal_is_blocked() || !sig_on_owner())
+            return 1;
+        cysigs.cancel_word = NULL;
+        sig_trace(SIG_TRACE_LONGJMP, SIG_CANCEL);
+        sig_leave_for_jump();
+        cylongjmp(cysigs.env, SIG_CANCEL);
+    }
+    cysigs.cancel_word = NULL;
+    _do_raise_exception(SIG_CANCEL);
+    return 0;
 }
 
-/* Cleanup after cylongjmp() (reset signal mask to the default, set
- * sig_on_count to zero) */
+/* Cleanup after cylongjmp(). The signal handler already set
+ * sig_on_count to zero and siglongjmp() restored the signal mask. */
 static void _sig_on_recover(void)
 {
+    cysignals_probe0(recover);
     cysigs.block_sigint = 0;
     custom_signal_unblock();
-    cysigs.sig_on_count = 0;
-    cysigs.interrupt_received = 0;
-    custom_set_pending_signal(0);
-
-#if HAVE_SIGPROCMASK
-    /* Reset signal mask */
-    sigprocmask(SIG_SETMASK, &default_sigmask, NULL);
-#endif
-
     cysigs.inside_signal_handler = 0;
+    if (unlikely(sig_stack.running)) _sig_stack_release();
+    if (unlikely(cysigs.buffer_count)) _sig_buffers_release();
+    sig_trace(SIG_TRACE_RECOVER, 0);
 }
 
 /* Give a warning that sig_off() was called without sig_on() */
@@ -630,32 +1927,129 @@ static void _sig_off_warning(const char* file, int line)
 }
 
 
+/* The signals handled by cysignals */
+static const int cysigs_signals[] = {
+#ifdef _WIN32
+    SIGINT, SIGTERM, SIGABRT,
+#else
+#ifdef SIGHUP
+    SIGHUP,
+#endif
+    SIGINT,
+#ifdef SIGALRM
+    SIGALRM,
+#endif
+#ifdef SIGQUIT
+    SIGQUIT,
+#endif
+    SIGILL, SIGABRT, SIGFPE,
+#ifdef SIGBUS
+    SIGBUS,
+#endif
+    SIGSEGV,
+#endif
+};
+
+#define CYSIGS_NSIGNALS (sizeof(cysigs_signals) / sizeof(cysigs_signals[0]))
+
+/* The handlers installed by cysignals. These are computed only once,
+ * by the first call of setup_cysignals_handlers(). */
+static sig_handlers_t cysigs_handlers;
+static int cysigs_handlers_ready = 0;
+
+
+/* Store the current handlers of the signals handled by cysignals in
+ * h. Return 0 on success or -1 with errno set. */
+static int sig_handlers_save(sig_handlers_t* h)
+{
+    size_t i;
+    for (i = 0; i < CYSIGS_NSIGNALS; i++)
+    {
+#ifdef _WIN32
+        /* signal() can only query the handler by changing it */
+        h->handler[i] = signal(cysigs_signals[i], SIG_DFL);
+        if (h->handler[i] == SIG_ERR) return -1;
+        signal(cysigs_signals[i], h->handler[i]);
+#else
+        if (sigaction(cysigs_signals[i], NULL, &h->action[i])) return -1;
+#endif
+    }
+    return 0;
+}
+
+
+/* Install the handlers stored in h. This costs one system call per
+ * signal. Return 0 on success or -1 with errno set. */
+static int sig_handlers_restore(const sig_handlers_t* h)
+{
+    size_t i;
+    for (i = 0; i < CYSIGS_NSIGNALS; i++)
+    {
+#ifdef _WIN32
+        if (signal(cysigs_signals[i], h->handler[i]) == SIG_ERR) return -1;
+#else
+        if (sigaction(cysigs_signals[i], &h->action[i], NULL)) return -1;
+#endif
+    }
+    return 0;
+}
+
+
 static void setup_alt_stack(void)
 {
 #if HAVE_SIGALTSTACK
     /* Space for the alternate signal stack. The size should be
      * of the form MINSIGSTKSZ + constant. The constant is chosen rather
-     * ad hoc but sufficiently large. */
+     * ad hoc but sufficiently large.
+     * The stack is allocated once per thread and reused when this is
+     * called again, for example after fork() on OS X. */
+#if defined(__GNUC__)
+    static __thread void* alt_stack = NULL;
+#else
+    static void* alt_stack = NULL;
+#endif
     stack_t ss;
     size_t stack_size = MINSIGSTKSZ + 5120 + BACKTRACELEN * sizeof(void*);
-    ss.ss_sp = malloc(stack_size);
+    if (alt_stack == NULL)
+    {
+        alt_stack = malloc(stack_size);
+        if (alt_stack == NULL) {perror("cysignals malloc alt signal stack"); exit(1);}
+    }
+    ss.ss_sp = alt_stack;
     ss.ss_size = stack_size;
-    if (ss.ss_sp == NULL) {perror("cysignals malloc alt signal stack"); exit(1);}
     ss.ss_flags = 0;
     if (sigaltstack(&ss, NULL) == -1) {perror("cysignals sigaltstack"); exit(1);}
 #endif
 #if defined(__CYGWIN__) && defined(__x86_64__)
-    cygwin_setup_alt_stack();
+    static int vectored_handler_added = 0;
+    if (!vectored_handler_added)
+    {
+        cygwin_setup_alt_stack();
+        vectored_handler_added = 1;
+    }
 #endif
 }
 
 
-static void setup_cysignals_handlers(void)
+#ifndef _WIN32
+/* Set the action of cysignals for the signal sig */
+static void cysigs_set_action(int sig, const struct sigaction* sa)
+{
+    size_t i;
+    for (i = 0; i < CYSIGS_NSIGNALS; i++)
+        if (cysigs_signals[i] == sig) cysigs_handlers.action[i] = *sa;
+}
+#endif
+
+
+/* Initialize the cysigs structure, the trampoline and cysigs_handlers.
+ * This must be done only once. */
+static void init_cysignals_handlers(void)
 {
 #ifdef _WIN32
-    signal(SIGINT, cysigs_interrupt_handler);
-    signal(SIGTERM, cysigs_interrupt_handler);
-    signal(SIGABRT, cysigs_signal_handler);
+    cysigs_handlers.handler[0] = cysigs_interrupt_handler;  /* SIGINT */
+    cysigs_handlers.handler[1] = cysigs_interrupt_handler;  /* SIGTERM */
+    cysigs_handlers.handler[2] = cysigs_signal_handler;     /* SIGABRT */
 #else
     struct sigaction sa;
     memset(&sa, 0, sizeof(sa));
@@ -664,32 +2058,27 @@ static void setup_cysignals_handlers(void)
     memset(&cysigs, 0, sizeof(cysigs));
 
 #if HAVE_SIGPROCMASK
-    /* Block non-critical signals during the signal handlers and while
-     * cleaning up after handling a signal */
+    /* Block non-critical signals during the signal handlers */
     sigaddset(&sa.sa_mask, SIGHUP);
     sigaddset(&sa.sa_mask, SIGINT);
     sigaddset(&sa.sa_mask, SIGALRM);
+    sigaddset(&sa.sa_mask, SIGVTALRM);
 
-    /* Save the default signal mask and apply the signal mask with
-     * non-critical signals now to save it on the trampoline.
-     * After setting up the trampoline, we reset the signal mask. */
-    sigprocmask(SIG_BLOCK, &sa.sa_mask, &default_sigmask);
+    /* Save the default signal mask, this is also the signal mask
+     * saved on the trampoline */
+    sigprocmask(SIG_SETMASK, NULL, &default_sigmask);
 #endif
     setup_trampoline();
-#if HAVE_SIGPROCMASK
-    sigprocmask(SIG_SETMASK, &default_sigmask, &sigmask_with_sigint);
-#endif
 
-    /* Install signal handlers */
     /* Handlers for interrupt-like signals */
     sa.sa_handler = cysigs_interrupt_handler;
     sa.sa_flags = 0;
 #ifdef SIGHUP
-    if (sigaction(SIGHUP, &sa, NULL)) {perror("cysignals sigaction"); exit(1);}
+    cysigs_set_action(SIGHUP, &sa);
 #endif
-    if (sigaction(SIGINT, &sa, NULL)) {perror("cysignals sigaction"); exit(1);}
+    cysigs_set_action(SIGINT, &sa);
 #ifdef SIGALRM
-    if (sigaction(SIGALRM, &sa, NULL)) {perror("cysignals sigaction"); exit(1);}
+    cysigs_set_action(SIGALRM, &sa);
 #endif
 
     /* Handlers for critical signals */
@@ -698,19 +2087,41 @@ static void setup_cysignals_handlers(void)
      * this case. */
     sa.sa_flags = SA_NODEFER | SA_ONSTACK;
 #ifdef SIGQUIT
-    if (sigaction(SIGQUIT, &sa, NULL)) {perror("cysignals sigaction"); exit(1);}
+    cysigs_set_action(SIGQUIT, &sa);
 #endif
-    if (sigaction(SIGILL, &sa, NULL)) {perror("cysignals sigaction"); exit(1);}
-    if (sigaction(SIGABRT, &sa, NULL)) {perror("cysignals sigaction"); exit(1);}
-    if (sigaction(SIGFPE, &sa, NULL)) {perror("cysignals sigaction"); exit(1);}
+    cysigs_set_action(SIGILL, &sa);
+    cysigs_set_action(SIGABRT, &sa);
+    /* Report which floating-point exception was trapped */
+    sa.sa_sigaction = cysigs_fpe_handler;
+    sa.sa_flags |= SA_SIGINFO;
+    cysigs_set_action(SIGFPE, &sa);
+    sa.sa_handler = cysigs_signal_handler;
+    sa.sa_flags &= ~SA_SIGINFO;
+    /* Check for an overflow of a dedicated stack and for guarded
+     * mappings */
+    sa.sa_sigaction = cysigs_fault_handler;
+    sa.sa_flags |= SA_SIGINFO;
 #ifdef SIGBUS
-    if (sigaction(SIGBUS, &sa, NULL)) {perror("cysignals sigaction"); exit(1);}
+    cysigs_set_action(SIGBUS, &sa);
 #endif
-    if (sigaction(SIGSEGV, &sa, NULL)) {perror("cysignals sigaction"); exit(1);}
+    cysigs_set_action(SIGSEGV, &sa);
 #endif
 }
 
 
+/* Install the signal handlers of cysignals. Only the first call
+ * initializes anything, later calls only install the handlers. */
+static void setup_cysignals_handlers(void)
+{
+    if (!cysigs_handlers_ready)
+    {
+        init_cysignals_handlers();
+        cysigs_handlers_ready = 1;
+    }
+    if (sig_handlers_restore(&cysigs_handlers)) {perror("cysignals sigaction"); exit(1);}
+}
+
+
 static void print_sep(void)
 {
     print_stderr("------------------------------------------------------------------------\n");
@@ -828,3 +2239,513 @@ dienow:
  * signals.pyx. These require some of the above functions, therefore
  * this include must come at the end of this file. */
 #include "macros.h"
+
+
+/* Free all storage registered by _sig_buffer_register(), in the same
+ * way as sig_free(). This uses _sig_free_limited(), so it must come
+ * after macros.h. */
+static void _sig_buffers_release(void)
+{
+    int i;
+    for (i = 0; i < SIG_BUFFER_MAX; i++)
+    {
+        void* ptr = sig_buffers[i].ptr;
+        if (sig_buffers[i].token == 0) continue;
+        if (sig_buffers[i].stats && ptr != NULL)
+            _sig_alloc_stats_free(_sig_mem_size(ptr));
+        if (cysigs.mem_limited)
+            _sig_free_limited(ptr);
+        else
+            free(ptr);
+    }
+    _sig_buffers_forget();
+}
+
+
+/* Call all shrink callbacks after allocating n bytes failed. Return
+ * the total number of bytes freed. This uses sig_block(), so it must
+ * come after macros.h. */
+static size_t _sig_mem_shrink(size_t n)
+{
+    int i;
+    size_t freed = 0;
+    for (i = 0; i < SIG_SHRINK_MAX; i++)
+    {
+        sig_shrink_acquire();
+        sig_shrink_t fn = sig_shrinkers[i].fn;
+        void* arg = sig_shrinkers[i].arg;
+        if (fn) sig_shrinkers[i].calls++;
+        sig_shrink_release();
+        if (fn == NULL) continue;
+
+        sig_block();
+        sig_shrink_mine[i]++;
+        freed += fn(n, arg);
+        sig_shrink_mine[i]--;
+        sig_unblock();
+
+        sig_shrink_acquire();
+        sig_shrinkers[i].calls--;
+        sig_shrink_release();
+    }
+    return freed;
+}
+
+
+/* Heartbeat callback
+ *
+ * sig_set_heartbeat(fn, arg, interval_ms) makes sig_check() call
+ * fn(file, line, arg) at most every interval_ms milliseconds, where
+ * file and line are the location of the current sig_on() call (NULL
+ * and 0 outside sig_on()). This can be used to publish liveness or
+ * progress of long computations. The callback is called with
+ * interrupts blocked by sig_block(). A NULL fn disables the heartbeat.
+ * When several threads call sig_check(), the callback may be called
+ * by any of them. */
+static long long sig_heartbeat_time(void)
+{
+    struct timespec ts;
+#if defined(CLOCK_MONOTONIC_COARSE)
+    /* Much cheaper and precise enough for intervals of milliseconds */
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    get_monotonic_time(&ts);
+#endif
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sig_set_heartbeat(sig_heartbeat_fn fn, void* arg, long interval_ms)
+{
+    cysigs.heartbeat_fn = NULL;
+    if (fn == NULL) return;
+    cysigs.heartbeat_arg = arg;
+    cysigs.heartbeat_interval = (long long)interval_ms * 1000000LL;
+    cysigs.heartbeat_next = sig_heartbeat_time() + cysigs.heartbeat_interval;
+    cysigs.heartbeat_fn = fn;
+}
+
+/* Called by sig_check() if a heartbeat callback is set. This uses
+ * sig_block(), so it must come after macros.h. */
+static void _sig_heartbeat(void)
+{
+    long long now = sig_heartbeat_time();
+    if (now < cysigs.heartbeat_next) return;
+    cysigs.heartbeat_next = now + cysigs.heartbeat_interval;
+
+    sig_heartbeat_fn fn = cysigs.heartbeat_fn;
+    void* arg = cysigs.heartbeat_arg;
+    if (fn == NULL) return;
+    sig_block();
+    if (cysigs.sig_on_count > 0)
+        fn(cysigs.sig_on_file, cysigs.sig_on_line, arg);
+    else
+        fn(NULL, 0, arg);
+    sig_unblock();
+}
+
+
+/* Call fn(arg) inside sig_on() on a dedicated stack of stack_size
+ * bytes. Return 0 on success. Return -1 with a Python exception set if
+ * an exception occurred (in particular RecursionError for an overflow
+ * of the dedicated stack) or if the stack could not be allocated.
+ * This uses sig_on(), so it must come after macros.h. */
+static int sig_call_on_stack(void (*fn)(void*), void* arg, size_t stack_size)
+{
+    if (sig_stack.running)
+    {
+        /* Nested call: we are already on a dedicated stack */
+        if (!sig_on()) return -1;
+        fn(arg);
+        sig_off();
+        return 0;
+    }
+
+#if SIG_STACK_SUPPORTED
+    /* A stack left behind by sig_retry() */
+    _sig_stack_release();
+
+#if HAVE_SIGALTSTACK
+    /* The signal handler for an overflow needs an alternate signal
+     * stack, which is only installed in the thread which initialized
+     * cysignals. Install one in this thread if needed. */
+    stack_t ss;
+    if (sigaltstack(NULL, &ss) == 0 && (ss.ss_flags & SS_DISABLE))
+        setup_alt_stack();
+#endif
+
+    if (_sig_stack_setup(stack_size) == -1)
+    {
+        PyGILState_STATE gilstate = PyGILState_Ensure();
+        PyErr_SetFromErrno(PyExc_OSError);
+        PyGILState_Release(gilstate);
+        return -1;
+    }
+    sig_stack.fn = fn;
+    sig_stack.arg = arg;
+
+    /* If an exception occurs, _sig_on_recover() releases the stack */
+    if (!sig_on()) return -1;
+    if (cysetjmp(sig_stack.ret) == 0)
+    {
+        sig_stack.running = 1;
+        cylongjmp(sig_stack.entry, 1);
+    }
+    sig_stack.running = 0;
+    sig_off();
+    _sig_stack_release();
+#else
+    /* Run on the current stack */
+    if (!sig_on()) return -1;
+    fn(arg);
+    sig_off();
+#endif
+    return 0;
+}
+
+
+/**********************************************************************
+ * Interruptible blocking calls                                       *
+ **********************************************************************/
+
+/* These functions block like the corresponding system calls, but an
+ * interrupt wakes them up. Outside sig_on(), they raise the exception
+ * for the interrupt and return -1. Inside sig_on(), the interrupt
+ * jumps back to sig_on() as usual. Errors raise OSError and return -1.
+ * Unlike a blocking call inside sig_on(), no lock is left held when
+ * an interrupt occurs outside sig_on(). */
+
+/* Set an OSError from errno with the GIL */
+static void _sig_set_oserror(int err)
+{
+    PyGILState_STATE gilstate = PyGILState_Ensure();
+    errno = err;
+    PyErr_SetFromErrno(PyExc_OSError);
+    PyGILState_Release(gilstate);
+}
+
+/* Return 1 if there is an interrupt that we should raise now */
+static inline int _sig_wait_interrupted(void)
+{
+    return cysigs.interrupt_received && cysigs.sig_on_count <= 0;
+}
+
+#if !_WIN32
+/* Wait until fd is ready for reading (or for writing if write is
+ * nonzero) or until the timeout (if not NULL) expires. A negative fd
+ * only waits for the timeout. Return 0 on success or -1 with an
+ * exception set.
+ *
+ * The interrupt signals are blocked except inside ppoll() or
+ * pselect(), which unblock them atomically, so an interrupt arriving
+ * just before we start waiting is not missed. Where ppoll() is
+ * available, fd is not limited to FD_SETSIZE. */
+static int _sig_wait_fd(int fd, int write, const struct timespec* timeout)
+{
+    sigset_t block, old;
+    int ret = 0;
+#if HAVE_PPOLL
+    struct pollfd pfd;
+#else
+    fd_set fds;
+
+    if (fd >= FD_SETSIZE)
+    {
+        _sig_set_oserror(EINVAL);
+        return -1;
+    }
+#endif
+
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+#ifdef SIGHUP
+    sigaddset(&block, SIGHUP);
+#endif
+#ifdef SIGALRM
+    sigaddset(&block, SIGALRM);
+#endif
+#ifdef SIGVTALRM
+    sigaddset(&block, SIGVTALRM);
+#endif
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    for (;;)
+    {
+        if (_sig_wait_interrupted())
+        {
+            pthread_sigmask(SIG_SETMASK, &old, NULL);
+            _sig_on_interrupt_received();
+            return -1;
+        }
+
+#if HAVE_PPOLL
+        pfd.fd = fd;  /* ppoll() ignores a negative fd */
+        pfd.events = write ? POLLOUT : POLLIN;
+        pfd.revents = 0;
+        int n = ppoll(&pfd, 1, timeout, &old);
+#else
+        FD_ZERO(&fds);
+        if (fd >= 0) FD_SET(fd, &fds);
+        int n = pselect(fd + 1, write ? NULL : &fds, write ? &fds : NULL,
+                        NULL, timeout, &old);
+#endif
+        if (n >= 0) break;
+        if (errno != EINTR)
+        {
+            ret = errno;
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (ret)
+    {
+        _sig_set_oserror(ret);
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+/* Like read(), but interruptible */
+static Py_ssize_t sig_read(int fd, void* buf, size_t count)
+{
+#if !_WIN32
+    for (;;)
+    {
+        if (_sig_wait_fd(fd, 0, NULL) == -1) return -1;
+        Py_ssize_t n = read(fd, buf, count);
+        if (n >= 0) return n;
+        if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+            break;
+    }
+    _sig_set_oserror(errno);
+#else
+    _sig_set_oserror(ENOSYS);
+#endif
+    return -1;
+}
+
+/* Like write(), but interruptible */
+static Py_ssize_t sig_write(int fd, const void* buf, size_t count)
+{
+#if !_WIN32
+    for (;;)
+    {
+        if (_sig_wait_fd(fd, 1, NULL) == -1) return -1;
+        Py_ssize_t n = write(fd, buf, count);
+        if (n >= 0) return n;
+        if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+            break;
+    }
+    _sig_set_oserror(errno);
+#else
+    _sig_set_oserror(ENOSYS);
+#endif
+    return -1;
+}
+
+/* Like waitpid(), but interruptible. On Linux, this waits on a pidfd
+ * for a specific child. Otherwise, it checks for the child every
+ * 10 milliseconds, but interrupts are still handled immediately. */
+static int sig_waitpid(int pid, int* status, int options)
+{
+#if HAVE_SYS_WAIT_H && !_WIN32
+    for (;;)
+    {
+        pid_t ret = waitpid(pid, status, options | WNOHANG);
+        if (ret == -1 && errno == EINTR) continue;
+        if (ret == -1)
+        {
+            _sig_set_oserror(errno);
+            return -1;
+        }
+        if (ret != 0 || (options & WNOHANG)) return ret;
+
+        int fd = -1;
+#if defined(__linux__) && defined(SYS_pidfd_open)
+        if (pid > 0) fd = syscall(SYS_pidfd_open, pid, 0);
+#endif
+        if (fd >= 0)
+        {
+            ret = _sig_wait_fd(fd, 0, NULL);
+            close(fd);
+        }
+        else
+        {
+            struct timespec slice = {0, 10000000};
+            ret = _sig_wait_fd(-1, 0, &slice);
+        }
+        if (ret == -1) return -1;
+    }
+#else
+    _sig_set_oserror(ENOSYS);
+    return -1;
+#endif
+}
+
+/* Wait on the futex word *addr while it contains val, like the Linux
+ * FUTEX_WAIT operation. This may return early (in particular when a
+ * signal is handled), so the caller must check *addr again. The futex
+ * may be in memory shared between processes. */
+static int sig_futex_wait(uint32_t* addr, uint32_t val)
+{
+#if defined(__linux__) && defined(SYS_futex)
+    /* The futex system call holds no lock, so it is safe to jump out
+     * of it with sig_on() */
+    if (!sig_on()) return -1;
+    long ret = syscall(SYS_futex, addr, 0 /* FUTEX_WAIT */, val, NULL, NULL, 0);
+    int err = errno;
+    sig_off();
+    if (ret == -1 && err != EAGAIN && err != EINTR)
+    {
+        _sig_set_oserror(err);
+        return -1;
+    }
+    return 0;
+#else
+    _sig_set_oserror(ENOSYS);
+    return -1;
+#endif
+}
+
+/* Wake up to n threads waiting on the futex word *addr. Return the
+ * number of threads woken up. */
+static int sig_futex_wake(uint32_t* addr, int n)
+{
+#if defined(__linux__) && defined(SYS_futex)
+    long ret = syscall(SYS_futex, addr, 1 /* FUTEX_WAKE */, n, NULL, NULL, 0);
+    if (ret == -1)
+    {
+        _sig_set_oserror(errno);
+        return -1;
+    }
+    return (int)ret;
+#else
+    _sig_set_oserror(ENOSYS);
+    return -1;
+#endif
+}
+
+#if !_WIN32
+/* A condition variable cannot be signalled from a signal handler.
+ * Instead, the interrupt handler writes to a pipe (sig_wake_fd) and a
+ * watcher thread broadcasts the condition variables of all threads in
+ * sig_cond_wait(). The broadcast is done with the mutex locked, so it
+ * cannot happen between the check for an interrupt and the wait. */
+typedef struct sig_cond_waiter
+{
+    pthread_cond_t* cond;
+    pthread_mutex_t* mutex;
+    struct sig_cond_waiter* next;
+} sig_cond_waiter;
+
+static sig_cond_waiter* cond_waiters;
+static pthread_mutex_t cond_waiters_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t cond_watcher_once = PTHREAD_ONCE_INIT;
+static int cond_watcher_error;
+
+static void* _sig_cond_watcher(void* arg)
+{
+    int fd = (int)(intptr_t)arg;
+    char buf[64];
+    for (;;)
+    {
+        if (read(fd, buf, sizeof(buf)) <= 0 && errno != EINTR) return NULL;
+
+        /* The waiters lock each mutex before cond_waiters_lock, so we
+         * must not block on a mutex here. If a mutex is busy, the
+         * waiter may be about to wait, so try again a bit later. */
+        int busy;
+        do
+        {
+            busy = 0;
+            pthread_mutex_lock(&cond_waiters_lock);
+            for (sig_cond_waiter* w = cond_waiters; w; w = w->next)
+            {
+                if (pthread_mutex_trylock(w->mutex) == 0)
+                {
+                    pthread_cond_broadcast(w->cond);
+                    pthread_mutex_unlock(w->mutex);
+                }
+                else
+                    busy = 1;
+            }
+            pthread_mutex_unlock(&cond_waiters_lock);
+            if (busy) usleep(1000);
+        } while (busy && cysigs.interrupt_received);
+    }
+}
+
+static void _sig_cond_watcher_start(void)
+{
+    int fds[2];
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    if (pipe(fds) == -1) {cond_watcher_error = errno; return;}
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+    /* The watcher thread must not handle signals */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int ret = pthread_create(&thread, &attr, _sig_cond_watcher, (void*)(intptr_t)fds[0]);
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (ret)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        cond_watcher_error = ret;
+        return;
+    }
+    sig_wake_fd = fds[1];
+}
+#endif
+
+/* Like pthread_cond_wait(), but interruptible. The mutex must be
+ * locked by the caller and it is locked again when this returns,
+ * also when an exception is raised. Like pthread_cond_wait(), this
+ * may return early, so the caller must check its condition again. */
+static int sig_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex)
+{
+#if !_WIN32
+    pthread_once(&cond_watcher_once, _sig_cond_watcher_start);
+    if (cond_watcher_error)
+    {
+        _sig_set_oserror(cond_watcher_error);
+        return -1;
+    }
+
+    sig_cond_waiter self = {cond, mutex, NULL};
+    pthread_mutex_lock(&cond_waiters_lock);
+    self.next = cond_waiters;
+    cond_waiters = &self;
+    pthread_mutex_unlock(&cond_waiters_lock);
+
+    /* Inside sig_on(), interrupts must not jump out of
+     * pthread_cond_wait(). They are raised by sig_unblock(). */
+    sig_block();
+    if (!_sig_wait_interrupted()) pthread_cond_wait(cond, mutex);
+
+    pthread_mutex_lock(&cond_waiters_lock);
+    sig_cond_waiter** p = &cond_waiters;
+    while (*p != &self) p = &(*p)->next;
+    *p = self.next;
+    pthread_mutex_unlock(&cond_waiters_lock);
+
+    sig_unblock();
+    if (_sig_wait_interrupted())
+    {
+        _sig_on_interrupt_received();
+        return -1;
+    }
+    return 0;
+#else
+    _sig_set_oserror(ENOSYS);
+    return -1;
+#endif
+}
@@ -0,0 +1,418 @@
+# cython: freethreading_compatible = True
+r"""
+Crash-isolated calls in pre-forked worker processes
+
+Inside ``sig_on()``, a segmentation fault raises a
+:class:`~cysignals.signals.SignalError`, but the memory of the process
+may be corrupted by then. This module runs calls which may crash in
+separate worker processes instead. A crash of the worker becomes a
+:class:`~cysignals.signals.SignalError` in the calling process, whose
+memory is left untouched.
+
+The workers are forked in advance and reused for many calls, so the
+cost of ``fork()`` is not paid on every call. Arguments and results
+are pickled and exchanged through a shared memory buffer, a pipe is
+only used to wake up the other side. A worker which crashes, times
+out or is interrupted is killed and replaced by a new one.
+
+The function and its arguments must be picklable. Since the workers
+are forked when the pool is created, functions are pickled by name and
+must be importable in the worker.
+
+EXAMPLES::
+
+    >>> import platform, pytest
+    >>> if platform.system() == 'Windows':
+    ...     pytest.skip('this doctest does not work on Windows')
+    >>> import os
+    >>> from cysignals.isolate import IsolatedPool, isolated_call
+    >>> isolated_call(divmod, (17, 5))
+    (3, 2)
+    >>> isolated_call(os.getpid) != os.getpid()
+    True
+    >>> from cysignals.tests import unguarded_dereference_null_pointer
+    >>> isolated_call(unguarded_dereference_null_pointer)
+    Traceback (most recent call last):
+    ...
+    cysignals.signals.SignalError: worker process killed by SIGSEGV
+    >>> isolated_call(int, ("x",))
+    Traceback (most recent call last):
+    ...
+    ValueError: invalid literal for int() with base 10: 'x'
+
+A pool with several workers can be used by several threads at the same
+time::
+
+    >>> from concurrent.futures import ThreadPoolExecutor
+    >>> with IsolatedPool(workers=2) as pool:
+    ...     with ThreadPoolExecutor(2) as ex:
+    ...         list(ex.map(lambda x: pool.call(abs, x), range(-3, 3)))
+    [3, 2, 1, 0, 1, 2]
+"""
+
+#*****************************************************************************
+#  cysignals is free software: you can redistribute it and/or modify it
+#  under the terms of the GNU Lesser General Public License as published
+#  by the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  cysignals is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU Lesser General Public License for more details.
+#
+#  You should have received a copy of the GNU Lesser General Public License
+#  along with cysignals.  If not, see <http://www.gnu.org/licenses/>.
+#
+#*****************************************************************************
+
+import mmap
+import os
+import pickle
+import select
+import signal
+import struct
+import threading
+from queue import SimpleQueue
+
+from .signals import SignalError
+
+
+# Every shared memory buffer starts with the length of the pickled
+# data as 64-bit unsigned integer
+cdef object header = struct.Struct("Q")
+
+# File descriptors of the pipes of all workers. A new worker closes
+# all of these except its own, such that a worker sees end-of-file when
+# its pool is closed and the pool sees end-of-file when a worker dies.
+cdef set worker_fds = set()
+cdef object worker_fds_lock = threading.Lock()
+
+
+cdef class Worker:
+    """
+    A worker process with its shared memory buffer and pipes.
+    """
+    cdef readonly int pid
+    cdef bint busy   # A call was sent, but its result not received
+    cdef int cmd_fd  # Write end of the pipe waking up the worker
+    cdef int res_fd  # Read end of the pipe waking up the pool
+    cdef object shm
+
+    def __init__(self, size_t buffer_size):
+        self.shm = mmap.mmap(-1, buffer_size)
+        cmd_r, cmd_w = os.pipe()
+        res_r, res_w = os.pipe()
+        cdef int pid = 0
+        with worker_fds_lock:
+            pid = os.fork()
+            if pid == 0:
+                try:
+                    for fd in worker_fds:
+                        os.close(fd)
+                    os.close(cmd_w)
+                    os.close(res_r)
+                    worker_main(cmd_r, res_w, self.shm)
+                finally:
+                    os._exit(0)
+            os.close(cmd_r)
+            os.close(res_w)
+            worker_fds.add(cmd_w)
+            worker_fds.add(res_r)
+        self.pid = pid
+        self.cmd_fd = cmd_w
+        self.res_fd = res_r
+
+    def call(self, fn, args, kwargs, timeout):
+        """
+        Call ``fn(*args, **kwargs)`` in the worker and return the result.
+        If an exception is raised while the worker is busy, the worker
+        must be killed.
+        """
+        data = pickle.dumps((fn, args, kwargs), pickle.HIGHEST_PROTOCOL)
+        put(self.shm, data)
+        self.busy = True
+        os.write(self.cmd_fd, b"c")
+
+        r, _, _ = select.select([self.res_fd], [], [], timeout)
+        if not r:
+            raise TimeoutError(f"isolated call did not finish within {timeout} seconds")
+        if not os.read(self.res_fd, 1):
+            # The worker died
+            _, status = os.waitpid(self.pid, 0)
+            self.pid = 0
+            if os.WIFSIGNALED(status):
+                sig = os.WTERMSIG(status)
+                try:
+                    name = signal.Signals(sig).name
+                except ValueError:
+                    name = f"signal {sig}"
+                raise SignalError(f"worker process killed by {name}")
+            raise RuntimeError(f"worker process exited with status {os.WEXITSTATUS(status)}")
+        self.busy = False
+
+        ok, value = pickle.loads(get(self.shm))
+        if not ok:
+            raise value
+        return value
+
+    def close(self, kill=False):
+        """
+        Stop the worker and wait for it to exit.
+        """
+        with worker_fds_lock:
+            for fd in (self.cmd_fd, self.res_fd):
+                if fd in worker_fds:
+                    worker_fds.remove(fd)
+                    os.close(fd)
+        if self.pid:
+            if kill:
+                os.kill(self.pid, signal.SIGKILL)
+            os.waitpid(self.pid, 0)
+            self.pid = 0
+        self.shm.close()
+
+
+cdef put(shm, data):
+    """
+    Store ``data`` in the shared memory buffer ``shm``.
+    """
+    cdef size_t n = len(data)
+    if n + header.size > len(shm):
+        raise ValueError(f"pickled data of {n} bytes does not fit in buffer of {len(shm)} bytes")
+    shm[header.size:header.size + n] = data
+    header.pack_into(shm, 0, n)
+
+
+cdef get(shm):
+    """
+    Return the data stored in the shared memory buffer ``shm``.
+    """
+    cdef size_t n = header.unpack_from(shm, 0)[0]
+    return shm[header.size:header.size + n]
+
+
+def worker_main(int cmd_fd, int res_fd, shm):
+    """
+    Main loop of a worker process: wait for a call, run it and store
+    the result. Return when the pool is closed.
+    """
+    # Crashes must kill the worker, such that the pool sees them.
+    # Interrupts are handled by the pool.
+    for sig in (signal.SIGSEGV, signal.SIGBUS, signal.SIGILL,
+                signal.SIGFPE, signal.SIGABRT):
+        signal.signal(sig, signal.SIG_DFL)
+    signal.signal(signal.SIGINT, signal.SIG_IGN)
+
+    while os.read(cmd_fd, 1):
+        try:
+            fn, args, kwargs = pickle.loads(get(shm))
+            result = (True, fn(*args, **kwargs))
+        except BaseException as e:
+            result = (False, e)
+        try:
+            data = pickle.dumps(result, pickle.HIGHEST_PROTOCOL)
+            put(shm, data)
+        except BaseException as e:
+            put(shm, pickle.dumps((False, RuntimeError(f"cannot return result of isolated call: {e!r}"))))
+        os.write(res_fd, b"r")
+
+
+cdef class IsolatedPool:
+    """
+    A pool of worker processes to run calls in isolation.
+
+    INPUT:
+
+    - ``workers`` -- (default: 1) the number of worker processes. This
+      is the number of calls which can run at the same time.
+
+    - ``buffer_size`` -- (default: 1 MiB) the size of the shared
+      memory buffer of each worker. The pickled arguments and the
+      pickled result must fit in it.
+
+    TESTS::
+
+        >>> import platform, pytest
+        >>> if platform.system() == 'Windows':
+        ...     pytest.skip('this doctest does not work on Windows')
+        >>> import time, os
+        >>> from cysignals.isolate import IsolatedPool
+        >>> pool = IsolatedPool()
+        >>> pool.call(time.sleep, 10, timeout=0.1)
+        Traceback (most recent call last):
+        ...
+        TimeoutError: isolated call did not finish within 0.1 seconds
+        >>> pool.call(os.abort)
+        Traceback (most recent call last):
+        ...
+        cysignals.signals.SignalError: worker process killed by SIGABRT
+        >>> pool.call(os._exit, 3)
+        Traceback (most recent call last):
+        ...
+        RuntimeError: worker process exited with status 3
+        >>> pool.call(bytes, 2**20)
+        Traceback (most recent call last):
+        ...
+        RuntimeError: cannot return result of isolated call: ValueError('pickled data of 1048597 bytes does not fit in buffer of 1048576 bytes')
+        >>> pool.call(divmod, 7, 2)
+        (3, 1)
+        >>> pool.close()
+        >>> pool.call(abs, 1)
+        Traceback (most recent call last):
+        ...
+        ValueError: pool is closed
+        >>> IsolatedPool(0)
+        Traceback (most recent call last):
+        ...
+        ValueError: the number of workers must be positive
+    """
+    cdef size_t buffer_size
+    cdef list workers
+    cdef object idle  # Idle workers, and None once the pool is closed
+    cdef object lock  # Protects workers and closed
+    cdef bint closed
+
+    def __init__(self, int workers=1, size_t buffer_size=1 << 20):
+        if workers <= 0:
+            raise ValueError("the number of workers must be positive")
+        self.buffer_size = buffer_size
+        self.workers = []
+        self.idle = SimpleQueue()
+        self.lock = threading.Lock()
+        for _ in range(workers):
+            w = Worker(buffer_size)
+            self.workers.append(w)
+            self.idle.put(w)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def call(self, fn, *args, timeout=None, **kwargs):
+        """
+        Call ``fn(*args, **kwargs)`` in a worker process and return the
+        result.
+
+        If the call raises an exception, it is raised again here. If
+        the worker crashes, :class:`~cysignals.signals.SignalError` is
+        raised. If ``timeout`` is given and the call takes more than
+        ``timeout`` seconds, ``TimeoutError`` is raised. If no worker
+        is available, this waits for one.
+
+        TESTS:
+
+        Closing the pool wakes up calls waiting for a worker and kills
+        running calls::
+
+            >>> import platform, pytest
+            >>> if platform.system() == 'Windows':
+            ...     pytest.skip('this doctest does not work on Windows')
+            >>> import threading, time
+            >>> from cysignals.isolate import IsolatedPool
+            >>> pool = IsolatedPool()
+            >>> errors = []
+            >>> def run():
+            ...     try:
+            ...         pool.call(time.sleep, 10)
+            ...     except BaseException as e:
+            ...         errors.append(e)
+            >>> threads = [threading.Thread(target=run) for _ in range(2)]
+            >>> for t in threads: t.start()
+            >>> time.sleep(0.5)
+            >>> pool.close()
+            >>> for t in threads: t.join()
+            >>> sorted(type(e).__name__ for e in errors)
+            ['SignalError', 'ValueError']
+        """
+        with self.lock:
+            if self.closed:
+                raise ValueError("pool is closed")
+        cdef Worker w = self.idle.get()
+        if w is None:
+            # Woken up by close(): wake up the next waiting call too
+            self.idle.put(None)
+            raise ValueError("pool is closed")
+        try:
+            return w.call(fn, args, kwargs, timeout)
+        except BaseException:
+            if not w.busy:
+                raise
+            # Replace the worker: it died or it is still busy
+            w.close(kill=True)
+            with self.lock:
+                if w in self.workers:
+                    self.workers.remove(w)
+                w = None
+                if not self.closed:
+                    w = Worker(self.buffer_size)
+                    self.workers.append(w)
+            raise
+        finally:
+            self.release(w)
+
+    cdef release(self, Worker w):
+        """
+        Put the worker ``w`` back in the idle queue, or stop it if the
+        pool was closed in the meantime.
+        """
+        if w is None:
+            return
+        with self.lock:
+            if not self.closed:
+                self.idle.put(w)
+                return
+        w.close(kill=True)
+
+    def close(self):
+        """
+        Stop all worker processes. Calls which are still running are
+        killed and raise :class:`~cysignals.signals.SignalError`.
+        Calls waiting for a worker raise ``ValueError``.
+        """
+        cdef Worker w
+        cdef bint closed = True
+        cdef list workers = None
+        with self.lock:
+            closed = self.closed
+            self.closed = True
+            workers = self.workers
+            self.workers = []
+        if closed:
+            return
+        idle = set()
+        while not self.idle.empty():
+            w = self.idle.get()
+            if w is not None:
+                idle.add(w)
+                w.close(kill=True)
+        # Wake up calls waiting for a worker
+        self.idle.put(None)
+        # The workers of running calls are stopped by release()
+        for w in workers:
+            if w not in idle and w.pid:
+                try:
+                    os.kill(w.pid, signal.SIGKILL)
+                except ProcessLookupError:
+                    pass  # Reaped by the call in the meantime
+
+
+cdef IsolatedPool default_pool = None
+cdef object default_pool_lock = threading.Lock()
+
+
+def isolated_call(fn, args=(), kwargs=None, timeout=None):
+    """
+    Call ``fn(*args, **kwargs)`` in a worker process of a shared
+    :class:`IsolatedPool` with one worker, which is created on first
+    use. See :meth:`IsolatedPool.call`.
+    """
+    global default_pool
+    with default_pool_lock:
+        if default_pool is None:
+            default_pool = IsolatedPool()
+    if kwargs is None:
+        kwargs = {}
+    return default_pool.call(fn, *args, timeout=timeout, **kwargs)
@@ -0,0 +1,35 @@
+/*
+ * The shared library libcysignals
+ *
+ * This library is only built if cysignals is configured with
+ * -Dshared_library=true. It holds the cysigs structure, such that
+ * Cython modules compiled with CYSIGNALS_DIRECT_LINK and linked with
+ * -lcysignals (see cysignals.pc) can access it directly, instead of
+ * through a pointer imported from cysignals.signals.
+ */
+
+/*****************************************************************************
+ *       Copyright (C) 2026 The Sage Developers
+ *
+ * cysignals is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cysignals is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cysignals.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#include "struct_signals.h"
+
+
+/* The cysigs object, shared by all Cython modules using cysignals.
+ * The functions of cysignals are in cysignals.signals, since they
+ * need the Python interpreter. */
+__attribute__((visibility("default"))) cysigs_t cysigs;
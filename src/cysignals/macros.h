@@ -3,12 +3,13 @@ Interrupt and signal handling for Cython.
 
 This code distinguishes between two kinds of signals:
 
-(1) interrupt-like signals: SIGINT, SIGALRM, SIGHUP.  The word
-"interrupt" refers to any of these signals.  These need not be handled
-immediately, we might handle them at a suitable later time, outside of
-sig_block() and with the Python GIL acquired.  SIGINT raises a
-KeyboardInterrupt (as usual in Python), SIGALRM raises AlarmInterrupt
-(a custom exception inheriting from KeyboardInterrupt), while SIGHUP
+(1) interrupt-like signals: SIGINT, SIGALRM, SIGVTALRM, SIGHUP.  The
+word "interrupt" refers to any of these signals.  These need not be
+handled immediately, we might handle them at a suitable later time,
+outside of sig_block() and with the Python GIL acquired.  SIGINT raises
+a KeyboardInterrupt (as usual in Python), SIGALRM raises AlarmInterrupt
+(a custom exception inheriting from KeyboardInterrupt) and SIGVTALRM
+raises its subclass CPUAlarmInterrupt, while SIGHUP
 raises SystemExit, causing Python to exit.  The latter signal also
 redirects stdin from /dev/null, to cause interactive sessions to exit.
 
@@ -47,13 +48,28 @@ will never be handled and always causes Python to exit.
 
 #include <setjmp.h>
 #include <signal.h>
+#include <stdlib.h>
+#include <errno.h>
 #include "struct_signals.h"
+#if !defined(_WIN32)
+#include <pthread.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 
+/* Modules compiled with CYSIGNALS_DIRECT_LINK defined to 1 and linked
+ * with libcysignals (see cysignals.pc) access the cysigs structure of
+ * the library directly. Otherwise, Cython defines cysigs as the
+ * pointer imported from cysignals.signals. */
+#if CYSIGNALS_DIRECT_LINK
+#undef cysigs
+extern cysigs_t cysigs;
+#endif
+
+
 /**********************************************************************
  * HELPER FUNCTIONS                                                   *
  **********************************************************************/
@@ -112,9 +128,13 @@ extern "C" {
 /*
  * Set message, return 0 if we need to cysetjmp(), return 1 otherwise.
  */
-static inline int _sig_on_prejmp(const char* message, CYTHON_UNUSED const char* file, CYTHON_UNUSED int line)
+static inline int _sig_on_prejmp(const char* message, const char* file, int line)
 {
     cysigs.s = message;
+    cysigs.s_format = 0;
+    cysigs.sig_on_file = file;
+    cysigs.sig_on_line = line;
+    cysignals_probe3(sig_on_prejmp, file, line, (int)cysigs.sig_on_count);
 #if ENABLE_DEBUG_CYSIGNALS
     if (cysigs.debug_level >= 4)
     {
@@ -136,10 +156,60 @@ static inline int _sig_on_prejmp(const char* message, CYTHON_UNUSED const char*
     }
 
     /* At this point, cysigs.sig_on_count == 0 */
+#if !_WIN32
+    cysigs.owner = pthread_self();
+#endif
+    cysigs.sig_on_serial++;
+    if (unlikely(cysigs.fptrap_excepts))
+        _sig_fptrap_enable(cysigs.fptrap_excepts);
     return 0;
 }
 
 
+/*
+ * Like _sig_on_prejmp(), but the message is a format string which is
+ * formatted with the given arguments only when an exception is raised.
+ */
+static inline int _sig_strf_prejmp(const char* format, long a, long b, long c, long d,
+                                   const char* file, int line)
+{
+    int ret = _sig_on_prejmp(format, file, line);
+    cysigs.s_args[0] = a;
+    cysigs.s_args[1] = b;
+    cysigs.s_args[2] = c;
+    cysigs.s_args[3] = d;
+    cysigs.s_format = 1;
+    return ret;
+}
+
+/* The arguments must be integers: "| 0" does not compile for floating
+ * point numbers and pointers */
+#define _sig_strf_(format, a, b, c, d, ...) ( unlikely(_sig_strf_prejmp(format, \
+        (long)((a) | 0), (long)((b) | 0), (long)((c) | 0), (long)((d) | 0), \
+        __FILE__, __LINE__)) || \
+        _sig_on_postjmp(cysetjmp(cysigs.env)) )
+
+/* The number of arguments after the format of sig_strf() (up to 9) */
+#define _sig_strf_nargs(...) _sig_strf_nargs_(__VA_ARGS__, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0, _)
+#define _sig_strf_nargs_(format, a1, a2, a3, a4, a5, a6, a7, a8, a9, n, ...) n
+
+/* Fail to compile (negative array size) if the condition is false. This
+ * is an expression, unlike _Static_assert(), and also works in C++. */
+#define _sig_static_assert(cond) ((void)sizeof(char[(cond) ? 1 : -1]))
+
+
+/*
+ * Return nonzero if a cancellation word is attached and nonzero. This
+ * is a plain memory access, such that another process can cancel a
+ * computation by writing to shared memory.
+ */
+static inline int _sig_cancel_pending(void)
+{
+    volatile int* word = cysigs.cancel_word;
+    return unlikely(word != NULL) && *word != 0;
+}
+
+
 /*
  * Process the return value of cysetjmp().
  * Return 0 if there was an exception, 1 otherwise.
@@ -152,6 +222,7 @@ static inline int _sig_on_prejmp(const char* message, CYTHON_UNUSED const char*
  */
 static inline int _sig_on_postjmp(int jmpret)
 {
+    cysignals_probe3(sig_on_postjmp, cysigs.sig_on_file, cysigs.sig_on_line, jmpret);
     if (unlikely(jmpret > 0))
     {
         /* A signal occurred and we jumped back via longjmp.
@@ -165,6 +236,11 @@ static inline int _sig_on_postjmp(int jmpret)
 
     /* When we are here, it's either the original sig_on() call or we
      * got here after sig_retry(). */
+    if (unlikely(cysigs.trace_enabled) && jmpret == 0)
+        _sig_trace_event(SIG_TRACE_ENTER, 0);
+    /* Buffers initialized inside the block are initialized again */
+    if (unlikely(jmpret < 0) && cysigs.buffer_count)
+        _sig_buffers_release();
     cysigs.sig_on_count = 1;
 
     /* Check whether we received an interrupt before this point.
@@ -179,6 +255,11 @@ static inline int _sig_on_postjmp(int jmpret)
         return 0;
     }
 
+    /* This jumps back to the sig_on() call above if the computation
+     * was cancelled */
+    if (unlikely(_sig_cancel_pending()))
+        _sig_cancel();
+
     return 1;
 }
 
@@ -189,6 +270,7 @@ static inline int _sig_on_postjmp(int jmpret)
  */
 static inline void _sig_off_(const char* file, int line)
 {
+    cysignals_probe3(sig_off, file, line, (int)cysigs.sig_on_count);
 #if ENABLE_DEBUG_CYSIGNALS
     if (cysigs.debug_level >= 4)
     {
@@ -203,7 +285,15 @@ static inline void _sig_off_(const char* file, int line)
     }
     else
     {
-        --cysigs.sig_on_count;
+        if (--cysigs.sig_on_count == 0)
+        {
+            if (unlikely(cysigs.trace_enabled))
+                _sig_trace_event(SIG_TRACE_EXIT, 0);
+            if (unlikely(cysigs.fptrap_active))
+                _sig_fptrap_restore();
+            if (unlikely(cysigs.buffer_count))
+                _sig_buffers_forget();
+        }
     }
 }
 
@@ -215,6 +305,15 @@ static inline void _sig_off_(const char* file, int line)
 /* The actual macros which should be used in a program. */
 #define sig_on()           _sig_on_(NULL)
 #define sig_str(message)   _sig_on_(message)
+/* sig_strf(format, ...) takes up to SIG_STRF_MAXARGS integer arguments,
+ * which are converted to long: use %ld, %lu or %lx in the format. More
+ * arguments or non-integer arguments are a compile error. */
+#define sig_strf(...)      ( _sig_static_assert(_sig_strf_nargs(__VA_ARGS__) <= SIG_STRF_MAXARGS), \
+                             _sig_strf_(__VA_ARGS__, 0, 0, 0, 0, 0) )
+/* Like sig_on(), but also enable the floating-point exceptions
+ * ``excepts`` (for example FE_INVALID | FE_OVERFLOW) as traps until the
+ * end of the outermost sig_on() region. */
+#define sig_on_fptrap(excepts) ( _sig_fptrap_enable(excepts), _sig_on_(NULL) )
 #define sig_off()          _sig_off_(__FILE__, __LINE__)
 
 /* sig_check() should be functionally equivalent to sig_on(); sig_off();
@@ -231,6 +330,12 @@ static inline int sig_check(void)
         return 0;
     }
 
+    if (unlikely(_sig_cancel_pending()))
+        return _sig_cancel();
+
+    if (unlikely(cysigs.heartbeat_fn != NULL))
+        _sig_heartbeat();
+
     return 1;
 }
 
@@ -309,6 +414,74 @@ static inline void sig_error(void)
 }
 
 
+/**********************************************************************
+ * MEMORY BUDGET                                                      *
+ **********************************************************************/
+
+/*
+ * Variants of malloc() and friends which charge the allocated memory
+ * against the memory budget in cysigs. These are used by the
+ * functions in memory.pxd when cysigs.mem_limited is set. An
+ * allocation which would exceed the budget fails with errno = ENOMEM.
+ *
+ * The requested size is first reserved with one atomic addition to
+ * mem_used, such that concurrent allocations cannot together exceed
+ * the budget. After the allocation, the reservation is corrected to
+ * the actual size of the block.
+ */
+
+/* Reserve n bytes of the memory budget. Return 0 if they do not fit.
+ * Since mem_limit is at most PY_SSIZE_T_MAX / 2 (see memory.pyx), the
+ * addition does not overflow. */
+static inline int _sig_mem_reserve(size_t n)
+{
+    Py_ssize_t limit = cysigs.mem_limit;
+    if (n > (size_t)limit) return 0;
+    if ((cysigs.mem_used += (Py_ssize_t)n) <= limit) return 1;
+    cysigs.mem_used -= (Py_ssize_t)n;
+    return 0;
+}
+
+static inline void* _sig_malloc_limited(size_t n)
+{
+    if (!_sig_mem_reserve(n)) {errno = ENOMEM; return NULL;}
+    void* ret = malloc(n);
+    cysigs.mem_used += (ret ? (Py_ssize_t)_sig_mem_size(ret) : 0) - (Py_ssize_t)n;
+    return ret;
+}
+
+static inline void* _sig_calloc_limited(size_t nmemb, size_t size)
+{
+    /* On overflow, the product is certainly over budget */
+    size_t n = (size && nmemb > (size_t)-1 / size) ? (size_t)-1 : nmemb * size;
+    if (!_sig_mem_reserve(n)) {errno = ENOMEM; return NULL;}
+    void* ret = calloc(nmemb, size);
+    cysigs.mem_used += (ret ? (Py_ssize_t)_sig_mem_size(ret) : 0) - (Py_ssize_t)n;
+    return ret;
+}
+
+static inline void* _sig_realloc_limited(void* ptr, size_t n)
+{
+    size_t old = ptr ? _sig_mem_size(ptr) : 0;
+    size_t grow = n > old ? n - old : 0;
+    if (!_sig_mem_reserve(grow)) {errno = ENOMEM; return NULL;}
+    void* ret = realloc(ptr, n);
+    if (ret)
+        cysigs.mem_used += (Py_ssize_t)_sig_mem_size(ret) - (Py_ssize_t)old - (Py_ssize_t)grow;
+    else if (n == 0)
+        cysigs.mem_used -= (Py_ssize_t)old;  /* realloc(ptr, 0) freed ptr */
+    else
+        cysigs.mem_used -= (Py_ssize_t)grow;
+    return ret;
+}
+
+static inline void _sig_free_limited(void* ptr)
+{
+    if (ptr) cysigs.mem_used -= (Py_ssize_t)_sig_mem_size(ptr);
+    free(ptr);
+}
+
+
 static inline int _set_debug_level(int level)
 {
 #if ENABLE_DEBUG_CYSIGNALS
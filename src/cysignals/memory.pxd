@@ -3,7 +3,20 @@ Memory allocation functions which are interrupt-safe
 
 The ``sig_`` variants are simple wrappers around the corresponding C
 functions. The ``check_`` variants check the return value and raise
-``MemoryError`` in case of failure.
+``MemoryError`` in case of failure. Before failing, they call the
+shrink callbacks (see ``add_shrinker()`` in ``memory.pyx``) and try
+again as long as these free memory.
+
+Inside ``with global_memory_limit(nbytes)`` (see ``memory.pyx``), these
+functions charge the allocated memory against the budget and fail if
+the budget would be exceeded.
+
+In modules compiled with the C macro ``CYSIGNALS_ALLOC_STATS`` defined
+to 1, these functions record allocation statistics, see
+``alloc_stats()`` in ``memory.pyx``. Otherwise, this has no cost.
+
+The ``sig_buffer`` type is a growable array which can be used without
+the GIL, see ``sig_buffer_init()`` below.
 """
 
 #*****************************************************************************
@@ -27,7 +40,12 @@ functions. The ``check_`` variants check the return value and raise
 
 cimport cython
 from libc.stdlib cimport malloc, calloc, realloc, free
-from .signals cimport sig_block, sig_unblock
+from libc.string cimport memcpy
+from .signals cimport (sig_block, sig_unblock, sig_retry, cysigs,
+        _sig_malloc_limited, _sig_calloc_limited, _sig_realloc_limited,
+        _sig_free_limited, _sig_mem_size, CYSIGNALS_ALLOC_STATS,
+        _sig_alloc_stats_alloc, _sig_alloc_stats_free, _sig_mem_shrink,
+        _sig_buffer_register, _sig_buffer_update, _sig_buffer_unregister)
 
 cdef extern from *:
     int unlikely(int) nogil  # Defined by Cython
@@ -35,28 +53,57 @@ cdef extern from *:
 
 cdef inline void* sig_malloc "sig_malloc"(size_t n) noexcept nogil:
     sig_block()
-    cdef void* ret = malloc(n)
+    cdef void* ret
+    if unlikely(cysigs.mem_limited):
+        ret = _sig_malloc_limited(n)
+    else:
+        ret = malloc(n)
+    if CYSIGNALS_ALLOC_STATS:
+        _sig_alloc_stats_alloc(ret, n, 0)
     sig_unblock()
     return ret
 
 
 cdef inline void* sig_realloc "sig_realloc"(void* ptr, size_t size) noexcept nogil:
     sig_block()
-    cdef void* ret = realloc(ptr, size)
+    cdef size_t old = 0
+    if CYSIGNALS_ALLOC_STATS and ptr is not NULL:
+        old = _sig_mem_size(ptr)
+    cdef void* ret
+    if unlikely(cysigs.mem_limited):
+        ret = _sig_realloc_limited(ptr, size)
+    else:
+        ret = realloc(ptr, size)
+    if CYSIGNALS_ALLOC_STATS:
+        if ret is not NULL:
+            _sig_alloc_stats_alloc(ret, size, old)
+        elif size == 0 and ptr is not NULL:
+            _sig_alloc_stats_free(old)  # realloc(ptr, 0) freed ptr
     sig_unblock()
     return ret
 
 
 cdef inline void* sig_calloc "sig_calloc"(size_t nmemb, size_t size) noexcept nogil:
     sig_block()
-    cdef void* ret = calloc(nmemb, size)
+    cdef void* ret
+    if unlikely(cysigs.mem_limited):
+        ret = _sig_calloc_limited(nmemb, size)
+    else:
+        ret = calloc(nmemb, size)
+    if CYSIGNALS_ALLOC_STATS:
+        _sig_alloc_stats_alloc(ret, nmemb * size, 0)
     sig_unblock()
     return ret
 
 
 cdef inline void sig_free "sig_free"(void* ptr) noexcept nogil:
     sig_block()
-    free(ptr)
+    if CYSIGNALS_ALLOC_STATS and ptr is not NULL:
+        _sig_alloc_stats_free(_sig_mem_size(ptr))
+    if unlikely(cysigs.mem_limited):
+        _sig_free_limited(ptr)
+    else:
+        free(ptr)
     sig_unblock()
 
 
@@ -75,6 +122,20 @@ cdef inline size_t mul_overflowcheck(size_t a, size_t b) noexcept nogil:
     return a*b
 
 
+cdef inline bint sig_shrink(size_t n) noexcept nogil:
+    """
+    Call the shrink callbacks after allocating ``n`` bytes failed.
+    Return whether memory was freed, such that the allocation should
+    be tried again. Inside ``restart_after_shrink`` and ``sig_on()``,
+    restart the ``sig_on()`` block with ``sig_retry()`` instead.
+    """
+    if n == <size_t>(-1) or not _sig_mem_shrink(n):
+        return False
+    if cysigs.mem_shrink_restart and cysigs.sig_on_count > 0:
+        sig_retry()
+    return True
+
+
 cdef inline void* check_allocarray(size_t nmemb, size_t size) except? NULL:
     """
     Allocate memory for ``nmemb`` elements of size ``size``.
@@ -83,8 +144,10 @@ cdef inline void* check_allocarray(size_t nmemb, size_t size) except? NULL:
         return NULL
     cdef size_t n = mul_overflowcheck(nmemb, size)
     cdef void* ret = sig_malloc(n)
-    if unlikely(ret == NULL):
-        raise MemoryError("failed to allocate %s * %s bytes" % (nmemb, size))
+    while unlikely(ret == NULL):
+        if not sig_shrink(n):
+            raise MemoryError("failed to allocate %s * %s bytes" % (nmemb, size))
+        ret = sig_malloc(n)
     return ret
 
 
@@ -101,8 +164,10 @@ cdef inline void* check_reallocarray(void* ptr, size_t nmemb, size_t size) excep
         return NULL
     cdef size_t n = mul_overflowcheck(nmemb, size)
     cdef void* ret = sig_realloc(ptr, n)
-    if unlikely(ret == NULL):
-        raise MemoryError("failed to allocate %s * %s bytes" % (nmemb, size))
+    while unlikely(ret == NULL):
+        if not sig_shrink(n):
+            raise MemoryError("failed to allocate %s * %s bytes" % (nmemb, size))
+        ret = sig_realloc(ptr, n)
     return ret
 
 
@@ -113,8 +178,10 @@ cdef inline void* check_malloc(size_t n) except? NULL:
     if n == 0:
         return NULL
     cdef void* ret = sig_malloc(n)
-    if unlikely(ret == NULL):
-        raise MemoryError("failed to allocate %s bytes" % n)
+    while unlikely(ret == NULL):
+        if not sig_shrink(n):
+            raise MemoryError("failed to allocate %s bytes" % n)
+        ret = sig_malloc(n)
     return ret
 
 
@@ -127,8 +194,10 @@ cdef inline void* check_realloc(void* ptr, size_t n) except? NULL:
         sig_free(ptr)
         return NULL
     cdef void* ret = sig_realloc(ptr, n)
-    if unlikely(ret == NULL):
-        raise MemoryError("failed to allocate %s bytes" % n)
+    while unlikely(ret == NULL):
+        if not sig_shrink(n):
+            raise MemoryError("failed to allocate %s bytes" % n)
+        ret = sig_realloc(ptr, n)
     return ret
 
 
@@ -140,6 +209,170 @@ cdef inline void* check_calloc(size_t nmemb, size_t size) except? NULL:
     if nmemb == 0:
         return NULL
     cdef void* ret = sig_calloc(nmemb, size)
-    if unlikely(ret == NULL):
-        raise MemoryError("failed to allocate %s * %s bytes" % (nmemb, size))
+    while unlikely(ret == NULL):
+        if not sig_shrink(mul_overflowcheck(nmemb, size)):
+            raise MemoryError("failed to allocate %s * %s bytes" % (nmemb, size))
+        ret = sig_calloc(nmemb, size)
     return ret
+
+
+# Growable buffers
+#
+# A sig_buffer holds ``size`` items of ``itemsize`` bytes at ``data``,
+# with room for ``capacity`` items. The first SIG_BUFFER_INLINE bytes
+# are stored inside the structure itself, so small buffers do not
+# allocate memory. Larger buffers are allocated with sig_malloc() and
+# sig_realloc(), doubling the capacity when needed. Since ``data`` may
+# point inside the structure, a sig_buffer must not be copied.
+#
+# A buffer initialized inside sig_on() belongs to the outermost
+# sig_on() block: if this block is interrupted (or restarted with
+# sig_retry()), the memory of the buffer is freed automatically and
+# the buffer must not be used anymore. After the outermost sig_off(),
+# it is an ordinary buffer. At most 64 buffers at a time are freed
+# automatically, further buffers are leaked on interruption.
+# Otherwise, the memory must be freed with sig_buffer_free() or moved
+# out with sig_buffer_release().
+#
+# Example:
+#
+#     cdef sig_buffer buf
+#     sig_on()
+#     sig_buffer_init(&buf, sizeof(long))
+#     for i in range(n):
+#         if is_interesting(i):
+#             (<long*>sig_buffer_push(&buf))[0] = i
+#     count = buf.size
+#     cdef long* result = <long*>sig_buffer_release(&buf)
+#     sig_off()
+
+cdef enum:
+    SIG_BUFFER_INLINE = 64
+
+ctypedef struct sig_buffer:
+    char* data
+    size_t size
+    size_t capacity
+    size_t itemsize
+    unsigned long long token
+    int slot
+    unsigned long serial
+    long long inline_data[8]  # SIG_BUFFER_INLINE bytes
+
+
+cdef inline void sig_buffer_init(sig_buffer* buf, size_t itemsize) noexcept nogil:
+    """
+    Initialize ``buf`` as empty buffer of items of ``itemsize`` bytes.
+    An ``itemsize`` of 0 is handled as 1.
+    """
+    if itemsize == 0:
+        itemsize = 1
+    buf.data = <char*>buf.inline_data
+    buf.size = 0
+    buf.capacity = SIG_BUFFER_INLINE // itemsize
+    buf.itemsize = itemsize
+    buf.token = 0
+    buf.slot = -1
+    buf.serial = cysigs.sig_on_serial if cysigs.sig_on_count > 0 else 0
+
+
+cdef inline int _sig_buffer_resize(sig_buffer* buf, size_t capacity) except -1 nogil:
+    """
+    Move the items of ``buf`` to memory allocated for ``capacity``
+    items, which must be at least ``buf.size``.
+    """
+    cdef size_t n = mul_overflowcheck(capacity, buf.itemsize)
+    cdef char* data
+    while True:
+        # Block interrupts while the registration is not up to date
+        sig_block()
+        if buf.data == <char*>buf.inline_data:
+            data = <char*>sig_malloc(n)
+            if data is not NULL:
+                memcpy(data, buf.data, buf.size * buf.itemsize)
+                if buf.serial:
+                    buf.slot = _sig_buffer_register(data, buf.serial, CYSIGNALS_ALLOC_STATS, &buf.token)
+        else:
+            data = <char*>sig_realloc(buf.data, n)
+            if data is not NULL:
+                _sig_buffer_update(buf.slot, buf.token, data)
+        if data is not NULL:
+            buf.data = data
+            buf.capacity = capacity
+        sig_unblock()
+        if data is not NULL:
+            return 0
+        if not sig_shrink(n):
+            with gil:
+                raise MemoryError("failed to allocate %s * %s bytes" % (capacity, buf.itemsize))
+
+
+cdef inline int sig_buffer_reserve(sig_buffer* buf, size_t n) except -1 nogil:
+    """
+    Make room for at least ``n`` items in ``buf``. If the buffer needs
+    to grow, its capacity is at least doubled.
+    """
+    if n <= buf.capacity:
+        return 0
+    cdef size_t capacity = 2 * buf.capacity
+    if capacity < n:
+        capacity = n
+    return _sig_buffer_resize(buf, capacity)
+
+
+cdef inline void* sig_buffer_push(sig_buffer* buf) except NULL nogil:
+    """
+    Append an uninitialized item to ``buf`` and return a pointer to it.
+    The pointer is valid until the buffer grows again.
+    """
+    if unlikely(buf.size == buf.capacity):
+        sig_buffer_reserve(buf, buf.size + 1)
+    cdef void* item = buf.data + buf.size * buf.itemsize
+    buf.size += 1
+    return item
+
+
+cdef inline int sig_buffer_extend(sig_buffer* buf, const void* items, size_t n) except -1 nogil:
+    """
+    Append the ``n`` items at ``items`` to ``buf``.
+    """
+    if unlikely(n > (<size_t>-1) - buf.size):
+        with gil:
+            raise MemoryError("failed to allocate %s + %s items" % (buf.size, n))
+    sig_buffer_reserve(buf, buf.size + n)
+    memcpy(buf.data + buf.size * buf.itemsize, items, n * buf.itemsize)
+    buf.size += n
+    return 0
+
+
+cdef inline void sig_buffer_free(sig_buffer* buf) noexcept nogil:
+    """
+    Free the memory of ``buf`` and make it empty. The buffer can still
+    be used afterwards.
+    """
+    sig_block()
+    if buf.data != <char*>buf.inline_data:
+        _sig_buffer_unregister(buf.slot, buf.token)
+        sig_free(buf.data)
+    sig_buffer_init(buf, buf.itemsize)
+    sig_unblock()
+
+
+cdef inline void* sig_buffer_release(sig_buffer* buf) except? NULL nogil:
+    """
+    Return the items of ``buf`` in memory which must be freed with
+    ``sig_free()`` by the caller (this memory is never freed
+    automatically) and make ``buf`` empty. Return ``NULL`` if the
+    buffer is empty.
+    """
+    if buf.size == 0:
+        sig_buffer_free(buf)
+        return NULL
+    if buf.data == <char*>buf.inline_data:
+        _sig_buffer_resize(buf, buf.size)
+    sig_block()
+    _sig_buffer_unregister(buf.slot, buf.token)
+    cdef void* data = buf.data
+    sig_buffer_init(buf, buf.itemsize)
+    sig_unblock()
+    return data
@@ -0,0 +1,379 @@
+# cython: freethreading_compatible = True
+# cython: preliminary_late_includes_cy28=True
+r"""
+Memory budgets and statistics for the interrupt-safe allocation functions
+
+The allocation functions from ``memory.pxd`` (``sig_malloc``,
+``check_malloc``, ``check_calloc``, ``check_reallocarray`` and so on)
+can be limited to a budget of bytes using the
+:class:`global_memory_limit` context manager. Inside the ``with``
+block, these functions charge every allocation against the budget and
+fail if it would be exceeded, so the ``check_`` variants raise
+``MemoryError``. This allows to abort a computation using too much
+memory long before the system runs out of memory. The budget is a
+coarse cap on the whole process, not on the code inside the ``with``
+block, see :class:`global_memory_limit`.
+
+EXAMPLES::
+
+    >>> from cysignals.memory import global_memory_limit
+    >>> from cysignals.tests import test_memory_limit
+    >>> with global_memory_limit(10**6) as m:
+    ...     test_memory_limit(1000, 10)
+    ...     m.used
+    0
+    >>> with global_memory_limit(10**6):
+    ...     test_memory_limit(10**5, 100)
+    Traceback (most recent call last):
+    ...
+    MemoryError: failed to allocate 100000 bytes
+
+When an allocation with one of the ``check_`` functions fails, for
+example because of the budget, the shrink callbacks registered with
+:func:`add_shrinker` are called to free memory (typically by evicting
+entries from a cache) and the allocation is tried again. This allows
+to use all available memory for caches without failing computations
+which need the memory.
+
+Modules compiled with the C macro ``CYSIGNALS_ALLOC_STATS`` defined to
+1 (for example by passing ``-DCYSIGNALS_ALLOC_STATS=1`` to the C
+compiler) record statistics about their allocations with these
+functions: the number of allocations per call site, a histogram of
+the allocation sizes and the number of allocated bytes. These can be
+inspected with :func:`alloc_stats`. In other modules, recording the
+statistics is compiled out. The module :mod:`cysignals.tests` is
+compiled with allocation statistics::
+
+    >>> import platform, pytest
+    >>> if platform.system() != 'Linux':
+    ...     pytest.skip('this doctest requires allocation statistics')
+    >>> from cysignals.memory import alloc_stats, reset_alloc_stats
+    >>> reset_alloc_stats()
+    >>> test_memory_limit(1000, 10)
+    >>> stats = alloc_stats()
+    >>> stats["histogram"][10]  # 512 <= n < 1024 bytes
+    10
+    >>> site, count, nbytes = stats["sites"][0]
+    >>> count, nbytes
+    (10, 10000)
+    >>> stats["frees"] >= 10
+    True
+"""
+
+#*****************************************************************************
+#  cysignals is free software: you can redistribute it and/or modify it
+#  under the terms of the GNU Lesser General Public License as published
+#  by the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  cysignals is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU Lesser General Public License for more details.
+#
+#  You should have received a copy of the GNU Lesser General Public License
+#  along with cysignals.  If not, see <http://www.gnu.org/licenses/>.
+#
+#*****************************************************************************
+
+from libc.stdlib cimport malloc, free
+from cpython.exc cimport PyErr_SetFromErrno
+from cpython.pyport cimport PY_SSIZE_T_MAX
+
+from .signals cimport *
+
+
+cdef class global_memory_limit:
+    """
+    Context manager limiting the memory allocated with the functions
+    from ``memory.pxd`` to ``nbytes`` bytes.
+
+    This is a coarse cap for the whole process: while the ``with``
+    block is active, the budget counts the bytes allocated minus the
+    bytes freed by all threads, not only by the code in the block.
+    Allocations are not tracked individually, so freeing memory which
+    was allocated before the block (or by another thread) gives room
+    for new allocations. When nested, the tightest limit applies.
+
+    INPUT:
+
+    - ``nbytes`` -- the maximal number of bytes
+
+    TESTS::
+
+        >>> from cysignals.memory import global_memory_limit
+        >>> from cysignals.tests import test_memory_limit
+        >>> with global_memory_limit(10**6) as m:
+        ...     with global_memory_limit(10**3):
+        ...         test_memory_limit(10**4, 1)
+        Traceback (most recent call last):
+        ...
+        MemoryError: failed to allocate 10000 bytes
+        >>> with global_memory_limit(10**3):
+        ...     with global_memory_limit(10**6):
+        ...         test_memory_limit(10**4, 1)
+        Traceback (most recent call last):
+        ...
+        MemoryError: failed to allocate 10000 bytes
+        >>> test_memory_limit(10**4, 1)  # No limit
+        >>> global_memory_limit(-1)
+        Traceback (most recent call last):
+        ...
+        ValueError: memory limit must be non-negative
+    """
+    cdef Py_ssize_t nbytes
+    cdef Py_ssize_t start_used
+    cdef Py_ssize_t saved_limit
+    cdef int saved_limited
+
+    def __init__(self, Py_ssize_t nbytes):
+        if nbytes < 0:
+            raise ValueError("memory limit must be non-negative")
+        if not CYSIGNALS_HAVE_MEM_SIZE:
+            raise RuntimeError("memory limits are not supported on this platform")
+        self.nbytes = nbytes
+
+    def __enter__(self):
+        self.saved_limited = cysigs.mem_limited
+        self.saved_limit = cysigs.mem_limit
+        if not self.saved_limited:
+            cysigs.mem_used = 0
+        self.start_used = cysigs.mem_used
+        cdef Py_ssize_t limit = self.start_used + self.nbytes
+        if self.saved_limited and self.saved_limit < limit:
+            limit = self.saved_limit
+        # Leave room for reservations exceeding the limit, see
+        # _sig_mem_reserve() in macros.h
+        if limit > PY_SSIZE_T_MAX // 2:
+            limit = PY_SSIZE_T_MAX // 2
+        cysigs.mem_limit = limit
+        cysigs.mem_limited = 1
+        return self
+
+    def __exit__(self, *args):
+        cysigs.mem_limit = self.saved_limit
+        cysigs.mem_limited = self.saved_limited
+
+    @property
+    def used(self):
+        """
+        The number of bytes currently charged against this budget.
+        This includes the overhead of the memory allocator.
+        """
+        return cysigs.mem_used - self.start_used
+
+
+def alloc_stats():
+    """
+    Return a snapshot of the allocation statistics, see above.
+
+    OUTPUT: a dict with keys
+
+    - ``"sites"`` -- a list of tuples ``(site, count, bytes)`` giving
+      for every call site the number of allocations and the total
+      number of bytes requested, sorted by decreasing count. A call site
+      is the address of the instruction following the call to the
+      allocation function, which can be converted to a function name
+      using :func:`cysignals.profiler.symbol_name`. The site 0
+      collects all call sites which did not fit in the table.
+
+    - ``"histogram"`` -- a list such that entry ``k`` is the number of
+      allocations of ``n`` bytes with ``2^(k-1) <= n < 2^k`` (entry 0
+      counts allocations of 0 bytes)
+
+    - ``"frees"`` -- the number of calls to ``sig_free()`` (or
+      equivalent) with a non-``NULL`` pointer
+
+    - ``"live"`` -- the number of allocated bytes, as reported by the
+      memory allocator (including its overhead)
+
+    - ``"peak"`` -- the maximum of ``"live"``
+
+    EXAMPLES::
+
+        >>> from cysignals.memory import alloc_stats
+        >>> sorted(alloc_stats())
+        ['frees', 'histogram', 'live', 'peak', 'sites']
+    """
+    cdef sig_alloc_totals_t totals
+    _sig_alloc_stats_totals(&totals)
+
+    cdef size_t size = _sig_alloc_stats_sites(NULL, 0)
+    cdef size_t n = 0, i
+    cdef sig_alloc_site_t* buf = NULL
+    while True:
+        # Leave some room for call sites appearing in the mean time
+        size += 16
+        buf = <sig_alloc_site_t*>malloc(size * sizeof(sig_alloc_site_t))
+        if buf is NULL:
+            raise MemoryError
+        n = _sig_alloc_stats_sites(buf, size)
+        if n <= size:
+            break
+        free(buf)
+        size = n
+
+    counts = {}
+    try:
+        for i in range(n):
+            site = <size_t>buf[i].site
+            c, b = counts.get(site, (0, 0))
+            counts[site] = (c + buf[i].count, b + buf[i].bytes)
+    finally:
+        free(buf)
+
+    sites = []
+    for site, (c, b) in counts.items():
+        sites.append((site, c, b))
+    sites.sort(key=lambda t: -t[1])
+    cdef int k
+    histogram = []
+    for k in range(SIG_ALLOC_CLASSES):
+        histogram.append(totals.histogram[k])
+    return {"sites": sites, "histogram": histogram, "frees": totals.frees,
+            "live": totals.live, "peak": totals.peak}
+
+
+def reset_alloc_stats():
+    """
+    Reset the allocation statistics, except for the number of live
+    bytes. The peak is set to the number of live bytes.
+    """
+    _sig_alloc_stats_reset()
+
+
+# Python shrink callbacks by id(), to keep them alive while registered
+cdef dict py_shrinkers = {}
+
+cdef size_t call_py_shrinker(size_t n, void* arg) noexcept with gil:
+    return (<object>arg)(n)
+
+
+def add_shrinker(func):
+    """
+    Register ``func`` as shrink callback: when allocating ``n`` bytes
+    with one of the ``check_`` functions from ``memory.pxd`` fails,
+    ``func(n)`` is called. It should free memory allocated with the
+    functions from ``memory.pxd`` (or by other means, if the allocation
+    failed because the system is out of memory) and return the number
+    of bytes freed. The allocation is tried again as long as some
+    callback freed memory, so ``func`` must return 0 once it has
+    nothing left to free. Exceptions raised by ``func`` are printed and
+    ignored.
+
+    From Cython, a C function ``size_t fn(size_t n, void* arg) noexcept
+    nogil`` can be registered with ``sig_add_shrinker(fn, arg)``.
+
+    EXAMPLES::
+
+        >>> import platform, pytest
+        >>> if platform.system() == 'Windows':
+        ...     pytest.skip('memory limits are not supported on Windows')
+        >>> from cysignals.memory import global_memory_limit, add_shrinker, remove_shrinker
+        >>> from cysignals.tests import MemoryBlock, test_memory_limit
+        >>> cache = []
+        >>> def evict(n):
+        ...     freed = sum(b.size for b in cache)
+        ...     cache.clear()
+        ...     return freed
+        >>> with global_memory_limit(10**5):
+        ...     cache += [MemoryBlock(10**4) for i in range(9)]
+        ...     test_memory_limit(10**4, 2)
+        Traceback (most recent call last):
+        ...
+        MemoryError: failed to allocate 10000 bytes
+        >>> add_shrinker(evict)
+        >>> with global_memory_limit(10**5):
+        ...     cache += [MemoryBlock(10**4) for i in range(9)]
+        ...     test_memory_limit(10**4, 2)
+        >>> cache
+        []
+        >>> remove_shrinker(evict)
+    """
+    if id(func) in py_shrinkers:
+        return
+    if sig_add_shrinker(call_py_shrinker, <void*>func) == -1:
+        PyErr_SetFromErrno(RuntimeError)
+    py_shrinkers[id(func)] = func
+
+
+def remove_shrinker(func):
+    """
+    Unregister a shrink callback registered with :func:`add_shrinker`.
+    Nothing happens if ``func`` is not registered. This waits until
+    ``func`` is no longer running in other threads. A callback may
+    remove itself.
+
+    EXAMPLES::
+
+        >>> import platform, pytest
+        >>> if platform.system() == 'Windows':
+        ...     pytest.skip('memory limits are not supported on Windows')
+        >>> from cysignals.memory import global_memory_limit, add_shrinker, remove_shrinker
+        >>> from cysignals.tests import test_memory_limit
+        >>> calls = []
+        >>> def once(n):
+        ...     calls.append(n)
+        ...     remove_shrinker(once)
+        ...     return 0
+        >>> add_shrinker(once)
+        >>> for i in range(2):
+        ...     with global_memory_limit(10**4):
+        ...         try:
+        ...             test_memory_limit(10**5, 1)
+        ...         except MemoryError:
+        ...             pass
+        >>> calls
+        [100000]
+    """
+    # Keep func alive until the calls in other threads are finished
+    func = py_shrinkers.pop(id(func), None)
+    if func is not None:
+        with nogil:
+            sig_remove_shrinker(call_py_shrinker, <void*>func)
+
+
+cdef class restart_after_shrink:
+    """
+    Context manager changing what happens when an allocation with one
+    of the ``check_`` functions fails inside ``sig_on()`` and the
+    shrink callbacks freed memory: instead of trying the allocation
+    again, the ``sig_on()`` block is restarted with ``sig_retry()``.
+
+    This is useful when the shrink callbacks may free memory which is
+    in use by the interrupted computation, for example cached data
+    which it looked up before. The ``sig_on()`` block must then be safe
+    to restart, as for ``sig_retry()``.
+
+    EXAMPLES::
+
+        >>> import platform, pytest
+        >>> if platform.system() == 'Windows':
+        ...     pytest.skip('memory limits are not supported on Windows')
+        >>> from cysignals.memory import *
+        >>> from cysignals.tests import MemoryBlock, test_shrink_restart
+        >>> cache = []
+        >>> def evict(n):
+        ...     freed = sum(b.size for b in cache)
+        ...     cache.clear()
+        ...     return freed
+        >>> add_shrinker(evict)
+        >>> with global_memory_limit(10**5):
+        ...     cache += [MemoryBlock(10**4) for i in range(9)]
+        ...     test_shrink_restart(2 * 10**4)  # number of passes
+        1
+        >>> with global_memory_limit(10**5), restart_after_shrink():
+        ...     cache += [MemoryBlock(10**4) for i in range(9)]
+        ...     test_shrink_restart(2 * 10**4)
+        2
+        >>> remove_shrinker(evict)
+    """
+    cdef int saved
+
+    def __enter__(self):
+        self.saved = cysigs.mem_shrink_restart
+        cysigs.mem_shrink_restart = 1
+        return self
+
+    def __exit__(self, *args):
+        cysigs.mem_shrink_restart = self.saved
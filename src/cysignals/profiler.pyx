@@ -0,0 +1,236 @@
+# cython: freethreading_compatible = True
+# cython: preliminary_late_includes_cy28=True
+r"""
+Sampling profiler for ``sig_on()`` regions
+
+This module profiles native code running inside ``sig_on()``, without
+external tools or ``ptrace()``. While the profiler is running, a
+``SIGPROF`` timer interrupts the thread which called :func:`start` at
+regular intervals of the CPU time of that thread. If that thread is
+inside ``sig_on()``, the signal handler records the native return addresses together with the source
+location of the innermost ``sig_on()`` call in a preallocated ring
+buffer. Samples outside ``sig_on()`` are ignored.
+
+Per-thread CPU timers are only used on Linux. On other systems, the
+timer measures the CPU time of the whole process and a sample is only
+recorded if the signal happens to be delivered to the thread inside
+``sig_on()``, so the sampling rate can be lower than requested.
+
+When the profiler is not running, the only cost is storing the file
+and line on every ``sig_on()``.
+
+EXAMPLES::
+
+    >>> import platform, pytest
+    >>> if platform.system() != 'Linux':
+    ...     pytest.skip('this doctest requires the profiler')
+    >>> from cysignals import profiler
+    >>> from cysignals.tests import sig_on_busy_loop
+    >>> profiler.start(interval=0.001)
+    >>> sig_on_busy_loop(0.2)
+    >>> profiler.stop()
+    >>> samples = profiler.drain()
+    >>> len(samples) > 0
+    True
+    >>> file, line, stack = samples[0]
+    >>> line > 0 and len(stack) > 0
+    True
+    >>> stacks = profiler.folded(samples).splitlines()
+    >>> "tests" in stacks[0].split(";")[0]
+    True
+    >>> profiler.drain()
+    []
+"""
+
+#*****************************************************************************
+#  cysignals is free software: you can redistribute it and/or modify it
+#  under the terms of the GNU Lesser General Public License as published
+#  by the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  cysignals is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU Lesser General Public License for more details.
+#
+#  You should have received a copy of the GNU Lesser General Public License
+#  along with cysignals.  If not, see <http://www.gnu.org/licenses/>.
+#
+#*****************************************************************************
+
+from libc.stdlib cimport free
+from cpython.exc cimport PyErr_SetFromErrno
+
+from .signals cimport *
+
+cdef extern from "<execinfo.h>":
+    char** backtrace_symbols(void** buffer, int size)
+
+# The include must be "late" (after the declaration of cysigs), so
+# the struct is declared separately
+cdef extern from *:
+    ctypedef struct profiler_sample_t:
+        const char* file
+        int line
+        int depth
+        void* pcs[1]
+
+cdef extern from "profiler_helper.c":
+    unsigned long PROFILER_MAX_CAPACITY
+    int profiler_start(double interval, size_t capacity)
+    void profiler_stop()
+    int profiler_pop(profiler_sample_t* out)
+    unsigned long profiler_dropped_samples()
+
+
+# Cache of symbol names for return addresses
+cdef dict symbol_names = {}
+
+
+def start(double interval=0.001, size_t buffer_size=4096):
+    """
+    Start the sampling profiler.
+
+    INPUT:
+
+    - ``interval`` -- (default: 0.001) the sampling interval in
+      seconds of CPU time
+
+    - ``buffer_size`` -- (default: 4096) the number of samples which
+      can be stored before calling :func:`drain`, at most `2^{20}`.
+      Samples which do not fit are counted by :func:`dropped`.
+
+    TESTS::
+
+        >>> import platform, pytest
+        >>> if platform.system() != 'Linux':
+        ...     pytest.skip('this doctest requires the profiler')
+        >>> from cysignals import profiler
+        >>> profiler.start()
+        >>> profiler.start()
+        Traceback (most recent call last):
+        ...
+        OSError: [Errno 16] Device or resource busy
+        >>> profiler.stop()
+        >>> profiler.stop()  # Calling more than once doesn't matter
+        >>> profiler.start(0)
+        Traceback (most recent call last):
+        ...
+        ValueError: sampling interval must be positive
+        >>> profiler.start(buffer_size=2**64 - 1)
+        Traceback (most recent call last):
+        ...
+        ValueError: buffer_size must be at most 1048576
+    """
+    if interval <= 0:
+        raise ValueError("sampling interval must be positive")
+    if buffer_size > PROFILER_MAX_CAPACITY:
+        raise ValueError(f"buffer_size must be at most {PROFILER_MAX_CAPACITY}")
+    if profiler_start(interval, buffer_size) == -1:
+        PyErr_SetFromErrno(OSError)
+
+
+def stop():
+    """
+    Stop the sampling profiler. The samples taken so far remain
+    available to :func:`drain`.
+    """
+    profiler_stop()
+
+
+def dropped():
+    """
+    Return the number of samples dropped because the buffer was full,
+    since the last call to :func:`start`.
+
+    EXAMPLES::
+
+        >>> from cysignals import profiler
+        >>> profiler.dropped()
+        0
+    """
+    return profiler_dropped_samples()
+
+
+def drain():
+    """
+    Remove all samples from the buffer and return them.
+
+    OUTPUT: a list of tuples ``(file, line, stack)`` where ``file`` and
+    ``line`` give the location of the ``sig_on()`` call and ``stack``
+    is a tuple of native return addresses, innermost frame first.
+    """
+    cdef profiler_sample_t sample
+    cdef int i
+    samples = []
+    while profiler_pop(&sample):
+        file = sample.file.decode("utf-8", "replace") if sample.file else "?"
+        stack = []
+        for i in range(sample.depth):
+            stack.append(<size_t>sample.pcs[i])
+        samples.append((file, sample.line, tuple(stack)))
+    return samples
+
+
+def symbol_name(size_t addr):
+    """
+    Return a human-readable name for the code at ``addr``: the name of
+    the function or, if it is not known, the library and the offset.
+
+    EXAMPLES::
+
+        >>> from cysignals.profiler import symbol_name
+        >>> isinstance(symbol_name(0x1234), str)
+        True
+    """
+    try:
+        return symbol_names[addr]
+    except KeyError:
+        pass
+
+    cdef void* ptr = <void*>addr
+    cdef char** syms = backtrace_symbols(&ptr, 1)
+    if syms is NULL:
+        name = hex(addr)
+    else:
+        # The format is "path(symbol+offset) [address]" where the
+        # symbol is missing for static functions
+        s = syms[0].decode("utf-8", "replace")
+        free(syms)
+        lib, _, rest = s.partition("(")
+        sym, _, offset = rest.partition(")")[0].partition("+")
+        name = sym or f"{lib.rpartition('/')[2]}+{offset}"
+    symbol_names[addr] = name
+    return name
+
+
+def folded(samples=None):
+    """
+    Return the samples in the "folded stacks" format understood by
+    ``flamegraph.pl`` and most flame graph viewers: one line per
+    distinct stack, with frames separated by ``;`` from the outermost
+    to the innermost, followed by the number of samples. The first
+    frame is the ``sig_on()`` site.
+
+    INPUT:
+
+    - ``samples`` -- (default: ``None``) a list of samples as returned
+      by :func:`drain`. If ``None``, call :func:`drain`.
+
+    EXAMPLES::
+
+        >>> from cysignals.profiler import folded
+        >>> print(folded([("kernel.c", 42, ())] * 3))
+        kernel.c:42 3
+    """
+    if samples is None:
+        samples = drain()
+    counts = {}
+    for file, line, stack in samples:
+        frames = [f"{file}:{line}"]
+        for addr in reversed(stack):
+            frames.append(symbol_name(addr))
+        key = ";".join(frames)
+        counts[key] = counts.get(key, 0) + 1
+    lines = [f"{key} {n}" for key, n in sorted(counts.items())]
+    return "\n".join(lines)
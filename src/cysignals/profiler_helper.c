@@ -0,0 +1,349 @@
+/*
+ * C functions for the sampling profiler in profiler.pyx
+ *
+ * A SIGPROF timer interrupts the thread which started the profiler at
+ * regular intervals of its CPU time. Where per-thread CPU timers are
+ * not available, an ITIMER_PROF timer measuring the CPU time of the
+ * whole process is used instead. If the interrupted thread is the one
+ * inside sig_on(), the signal handler stores the sig_on() site (file and line) and the native
+ * return addresses in a preallocated ring buffer. The buffer is a
+ * bounded lock-free queue (one sequence number per slot), so the
+ * handler never blocks and never allocates: if the buffer is full,
+ * the sample is simply counted as dropped.
+ */
+
+/*****************************************************************************
+ *       Copyright (C) 2026 The Sage Developers
+ *
+ * cysignals is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cysignals is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cysignals.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+#if HAVE_EXECINFO_H
+#include <execinfo.h>
+#endif
+
+/* The profiler needs lock-free atomics and backtrace() */
+#if CYSIGNALS_C_ATOMIC && HAVE_BACKTRACE && defined(SIGPROF)
+#define PROFILER_SUPPORTED 1
+#else
+#define PROFILER_SUPPORTED 0
+#endif
+
+#if PROFILER_SUPPORTED
+#include <stdatomic.h>
+#endif
+
+/* Sample the CPU time of one thread with a POSIX timer sending the
+ * signal to that thread, see alarm_helper.c */
+#if PROFILER_SUPPORTED && HAVE_TIMER_CREATE && defined(CLOCK_THREAD_CPUTIME_ID) && \
+    defined(__linux__) && defined(SIGEV_THREAD_ID) && defined(SYS_gettid)
+#define PROFILER_THREAD_TIMER 1
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#else
+#define PROFILER_THREAD_TIMER 0
+#endif
+
+/* Maximal number of samples in the buffer */
+#define PROFILER_MAX_CAPACITY (1UL << 20)
+
+/* Maximal number of return addresses stored per sample */
+#define PROFILER_MAXDEPTH 32
+
+typedef struct
+{
+    const char* file;
+    int line;
+    int depth;
+    void* pcs[PROFILER_MAXDEPTH];
+} profiler_sample_t;
+
+
+#if PROFILER_SUPPORTED
+typedef struct
+{
+    _Atomic unsigned long seq;
+    profiler_sample_t sample;
+} profiler_slot_t;
+
+static profiler_slot_t* profiler_buffer;
+static unsigned long profiler_mask;
+static _Atomic unsigned long profiler_enqueue_pos;
+static _Atomic unsigned long profiler_dequeue_pos;
+static _Atomic unsigned long profiler_dropped;
+static int profiler_running;
+static struct sigaction profiler_oldaction;
+#if PROFILER_THREAD_TIMER
+static timer_t profiler_timer;
+#endif
+
+
+/* Handler for SIGPROF. This only uses async-signal-safe operations:
+ * atomics on the (preallocated) ring buffer and backtrace(), which
+ * has been called once before installing the handler to make sure
+ * that the unwinder library is loaded. */
+static void profiler_handler(CYTHON_UNUSED int sig)
+{
+    int saved_errno = errno;
+    void* pcs[PROFILER_MAXDEPTH + 2];
+    profiler_slot_t* slot;
+    unsigned long pos, seq;
+    int depth;
+
+    /* Only sample the thread inside sig_on(): with ITIMER_PROF, the
+     * signal can be delivered to any thread of the process and its
+     * stack would be attributed to the wrong sig_on() site. */
+    if (cysigs.sig_on_count <= 0 || !pthread_equal(pthread_self(), cysigs.owner))
+        goto out;
+
+    pos = atomic_load_explicit(&profiler_enqueue_pos, memory_order_relaxed);
+    for (;;)
+    {
+        slot = &profiler_buffer[pos & profiler_mask];
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        long dif = (long)seq - (long)pos;
+        if (dif == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&profiler_enqueue_pos,
+                    &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (dif < 0)
+        {
+            /* Buffer full */
+            atomic_fetch_add_explicit(&profiler_dropped, 1, memory_order_relaxed);
+            goto out;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&profiler_enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    slot->sample.file = cysigs.sig_on_file;
+    slot->sample.line = cysigs.sig_on_line;
+
+    /* Skip this handler and the signal trampoline of the C library */
+    depth = backtrace(pcs, PROFILER_MAXDEPTH + 2) - 2;
+    if (depth < 0) depth = 0;
+    memcpy(slot->sample.pcs, pcs + 2, depth * sizeof(void*));
+    slot->sample.depth = depth;
+
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+out:
+    errno = saved_errno;
+}
+
+
+/* Start the timer sending SIGPROF every ``interval`` seconds of CPU
+ * time. Return 0 on success, -1 with errno set on failure. */
+static int profiler_start_timer(double interval)
+{
+#if PROFILER_THREAD_TIMER
+    struct sigevent sev;
+    struct itimerspec its;
+
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_signo = SIGPROF;
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &profiler_timer)) return -1;
+
+    its.it_interval.tv_sec = (time_t)interval;
+    its.it_interval.tv_nsec = (long)((interval - its.it_interval.tv_sec) * 1e9);
+    if (its.it_interval.tv_sec == 0 && its.it_interval.tv_nsec == 0)
+        its.it_interval.tv_nsec = 1;
+    its.it_value = its.it_interval;
+    if (timer_settime(profiler_timer, 0, &its, NULL))
+    {
+        int saved_errno = errno;
+        timer_delete(profiler_timer);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+#else
+    struct itimerval itv;
+
+    itv.it_interval.tv_sec = (time_t)interval;
+    itv.it_interval.tv_usec = (suseconds_t)((interval - itv.it_interval.tv_sec) * 1e6);
+    if (itv.it_interval.tv_sec == 0 && itv.it_interval.tv_usec == 0)
+        itv.it_interval.tv_usec = 1;
+    itv.it_value = itv.it_interval;
+    return setitimer(ITIMER_PROF, &itv, NULL);
+#endif
+}
+
+
+/* Start sampling every ``interval`` seconds of CPU time, storing at
+ * most ``capacity`` samples (rounded up to a power of 2, at most
+ * PROFILER_MAX_CAPACITY). Return 0 on success, -1 with errno set on
+ * failure. */
+static int profiler_start(double interval, size_t capacity)
+{
+    struct sigaction sa;
+    unsigned long i, n;
+
+    if (profiler_running) {errno = EBUSY; return -1;}
+    if (capacity > PROFILER_MAX_CAPACITY) {errno = EINVAL; return -1;}
+
+    n = 1;
+    while (n < capacity) n <<= 1;
+
+    /* Reuse the buffer of a previous run if it is large enough. The
+     * buffer is kept after profiler_stop() such that the remaining
+     * samples can still be read. */
+    if (profiler_buffer == NULL || profiler_mask + 1 < n)
+    {
+        profiler_slot_t* buf = malloc(n * sizeof(profiler_slot_t));
+        if (buf == NULL) return -1;
+        free(profiler_buffer);
+        profiler_buffer = buf;
+    }
+    else
+    {
+        n = profiler_mask + 1;
+    }
+    profiler_mask = n - 1;
+    for (i = 0; i < n; i++)
+        atomic_init(&profiler_buffer[i].seq, i);
+    atomic_store(&profiler_enqueue_pos, 0);
+    atomic_store(&profiler_dequeue_pos, 0);
+    atomic_store(&profiler_dropped, 0);
+
+    /* Make sure that backtrace() does not need to allocate memory
+     * (to load libgcc) when it is first called by the handler. */
+    void* dummy[2];
+    backtrace(dummy, 2);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = profiler_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, &profiler_oldaction)) return -1;
+
+    if (profiler_start_timer(interval))
+    {
+        int saved_errno = errno;
+        sigaction(SIGPROF, &profiler_oldaction, NULL);
+        errno = saved_errno;
+        return -1;
+    }
+
+    profiler_running = 1;
+    return 0;
+}
+
+
+/* Stop the timer and restore the previous SIGPROF handler. If that
+ * was the default action (which terminates the process), SIGPROF is
+ * ignored instead: this discards any signal which is still pending. */
+static void profiler_stop(void)
+{
+    if (!profiler_running) return;
+
+#if PROFILER_THREAD_TIMER
+    timer_delete(profiler_timer);
+#else
+    struct itimerval itv;
+    memset(&itv, 0, sizeof(itv));
+    setitimer(ITIMER_PROF, &itv, NULL);
+#endif
+
+    if (profiler_oldaction.sa_handler == SIG_DFL)
+        profiler_oldaction.sa_handler = SIG_IGN;
+    sigaction(SIGPROF, &profiler_oldaction, NULL);
+    profiler_running = 0;
+}
+
+
+/* Remove the oldest sample from the buffer and copy it to ``out``.
+ * Return 1 if a sample was available, 0 otherwise. */
+static int profiler_pop(profiler_sample_t* out)
+{
+    profiler_slot_t* slot;
+    unsigned long pos, seq;
+
+    if (profiler_buffer == NULL) return 0;
+
+    pos = atomic_load_explicit(&profiler_dequeue_pos, memory_order_relaxed);
+    for (;;)
+    {
+        slot = &profiler_buffer[pos & profiler_mask];
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        long dif = (long)seq - (long)(pos + 1);
+        if (dif == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&profiler_dequeue_pos,
+                    &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (dif < 0)
+        {
+            /* Buffer empty */
+            return 0;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&profiler_dequeue_pos, memory_order_relaxed);
+        }
+    }
+
+    *out = slot->sample;
+    atomic_store_explicit(&slot->seq, pos + profiler_mask + 1, memory_order_release);
+    return 1;
+}
+
+
+static unsigned long profiler_dropped_samples(void)
+{
+    return atomic_load(&profiler_dropped);
+}
+
+#else  /* PROFILER_SUPPORTED */
+
+static int profiler_start(CYTHON_UNUSED double interval, CYTHON_UNUSED size_t capacity)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+static void profiler_stop(void) { }
+
+static int profiler_pop(CYTHON_UNUSED profiler_sample_t* out)
+{
+    return 0;
+}
+
+static unsigned long profiler_dropped_samples(void)
+{
+    return 0;
+}
+
+#endif  /* PROFILER_SUPPORTED */
@@ -11,6 +11,28 @@ call the system call ``pselect()`` and which can also be used in a
 Waiting for subprocesses
 ------------------------
 
+On Linux, specific child processes can be waited for using
+:class:`ChildProcess`, which is backed by a process file descriptor
+(``pidfd``). This is ready for reading when the process exits, so
+children can be waited for together with other files, without a
+``SIGCHLD`` handler::
+
+    >>> import platform, pytest
+    >>> if platform.system() != 'Linux':
+    ...     pytest.skip('this doctest requires pidfd')
+    >>> from cysignals.pselect import PSelecter, ChildProcess
+    >>> from subprocess import Popen
+    >>> import os
+    >>> fast = Popen(["sleep", "0.2"])
+    >>> slow = Popen(["sleep", "30"])
+    >>> pr, pw = os.pipe()
+    >>> with ChildProcess(fast) as c1, ChildProcess(slow) as c2:
+    ...     r, w, x, t = PSelecter().pselect([c1, c2, pr], timeout=10)
+    >>> r == [c1], fast.wait()
+    (True, 0)
+    >>> slow.kill(); _ = slow.wait(); os.close(pr); os.close(pw)
+
+
 One possible use is to wait with a **timeout** until **any child process**
 exits, as opposed to ``os.wait()`` which doesn't have a timeout or
 ``multiprocessing.Process.join()`` which waits for one specific process.
@@ -85,10 +107,30 @@ For SIGCHLD-based monitoring (requires 'fork' on Python 3.14+)::
 #*****************************************************************************
 
 cimport libc.errno
+from libc.stdlib cimport malloc, free
 from posix.signal cimport *
 from posix.select cimport *
+from posix.unistd cimport close
 from cpython.exc cimport PyErr_SetFromErrno
 
+cdef extern from "<poll.h>" nogil:
+    struct pollfd:
+        int fd
+        short events
+        short revents
+    enum:
+        POLLIN
+        POLLPRI
+        POLLOUT
+        POLLERR
+        POLLHUP
+        POLLNVAL
+
+cdef extern from "pselect_helper.c" nogil:
+    int HAVE_PPOLL
+    int ppoll_(pollfd* fds, unsigned long nfds, const timespec* timeout, const sigset_t* sigmask)
+    int pidfd_open_(int pid)
+
 
 def interruptible_sleep(double seconds):
     """
@@ -182,17 +224,110 @@ cpdef int get_fileno(f) except -1:
         ...
         ValueError: Invalid file descriptor
 
+    """
+    cdef int n = fileno_of(f)
+    if n >= FD_SETSIZE:
+        raise ValueError("Invalid file descriptor")
+    return n
+
+
+cdef int fileno_of(f) except -1:
+    """
+    Like :func:`get_fileno` but without upper bound
     """
     cdef int n
     try:
         n = f.fileno()
     except AttributeError:
         n = f
-    if n < 0 or n >= FD_SETSIZE:
+    if n < 0:
         raise ValueError("Invalid file descriptor")
     return n
 
 
+cdef class ChildProcess:
+    """
+    A child process which can be waited for with
+    :meth:`PSelecter.pselect`: it is ready for reading when the process
+    has exited. This uses a process file descriptor (``pidfd``), which
+    requires Linux 5.3 or later.
+
+    This does not reap the process: use ``Popen.wait()``,
+    ``Process.join()`` or ``os.waitpid()`` for that.
+
+    INPUT:
+
+    - ``process`` -- a process id or an object with a ``pid``
+      attribute, such as :class:`subprocess.Popen` or
+      :class:`multiprocessing.Process`
+
+    TESTS::
+
+        >>> import platform, pytest
+        >>> if platform.system() != 'Linux':
+        ...     pytest.skip('this doctest requires pidfd')
+        >>> import os
+        >>> from cysignals.pselect import ChildProcess
+        >>> c = ChildProcess(os.getpid())
+        >>> c.fileno() > 2
+        True
+        >>> c.pid == os.getpid()
+        True
+        >>> c.close()
+        >>> c.fileno()
+        Traceback (most recent call last):
+        ...
+        ValueError: I/O operation on closed ChildProcess
+        >>> ChildProcess(-1)
+        Traceback (most recent call last):
+        ...
+        OSError: [Errno 22] Invalid argument
+    """
+    cdef readonly int pid
+    cdef int fd
+
+    def __cinit__(self):
+        self.fd = -1
+
+    def __init__(self, process):
+        try:
+            self.pid = process.pid
+        except AttributeError:
+            self.pid = process
+        self.fd = pidfd_open_(self.pid)
+        if self.fd < 0:
+            PyErr_SetFromErrno(OSError)
+
+    def __dealloc__(self):
+        if self.fd >= 0:
+            close(self.fd)
+
+    def fileno(self):
+        """
+        Return the process file descriptor.
+        """
+        if self.fd < 0:
+            raise ValueError("I/O operation on closed ChildProcess")
+        return self.fd
+
+    def close(self):
+        """
+        Close the process file descriptor.
+        """
+        if self.fd >= 0:
+            close(self.fd)
+            self.fd = -1
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def __repr__(self):
+        return f"<ChildProcess pid={self.pid}>"
+
+
 cdef class PSelecter:
     """
     This class gives an interface to the ``pselect`` system call.
@@ -358,6 +493,11 @@ cdef class PSelecter:
         If ``pselect`` was interrupted by a signal, the output is
         ``([], [], [], False)``.
 
+        Where available (for example on Linux), this uses the
+        ``ppoll()`` system call, so the number of file descriptors is
+        not limited by ``FD_SETSIZE``. The lists may contain
+        :class:`ChildProcess` objects to wait for processes.
+
         .. SEEALSO::
 
             Use the :meth:`sleep` method instead if you don't care about
@@ -422,6 +562,21 @@ cdef class PSelecter:
             OSError: ...
 
         """
+        cdef double tm
+        cdef timespec tv
+        cdef timespec *ptv = NULL
+        cdef int ret
+        if timeout is not None:
+            tm = timeout
+            if tm < 0:
+                tm = 0
+            tv.tv_sec = <long>tm
+            tv.tv_nsec = <long>(1e9 * (tm - <double>tv.tv_sec))
+            ptv = &tv
+
+        if HAVE_PPOLL:
+            return self._ppoll(rlist, wlist, xlist, ptv)
+
         # Convert given lists to fd_set
         cdef fd_set rfds, wfds, xfds
         FD_ZERO(&rfds)
@@ -443,18 +598,6 @@ cdef class PSelecter:
             if (n >= nfds): nfds = n + 1
             FD_SET(n, &xfds)
 
-        cdef double tm
-        cdef timespec tv
-        cdef timespec *ptv = NULL
-        cdef int ret
-        if timeout is not None:
-            tm = timeout
-            if tm < 0:
-                tm = 0
-            tv.tv_sec = <long>tm
-            tv.tv_nsec = <long>(1e9 * (tm - <double>tv.tv_sec))
-            ptv = &tv
-
         with nogil:
             ret = pselect(nfds, &rfds, &wfds, &xfds, ptv, &self.oldset)
 
@@ -487,6 +630,59 @@ cdef class PSelecter:
 
         return (rready, wready, xready, False)
 
+    cdef _ppoll(self, rlist, wlist, xlist, timespec* ptv):
+        """
+        Implementation of :meth:`pselect` using ``ppoll()``
+        """
+        lists = (rlist, wlist, xlist)
+        cdef short events[3]
+        events[0] = POLLIN
+        events[1] = POLLOUT
+        events[2] = POLLPRI
+        # Like select(), consider errors and hangups as ready
+        cdef short ready[3]
+        ready[0] = POLLIN | POLLHUP | POLLERR
+        ready[1] = POLLOUT | POLLHUP | POLLERR
+        ready[2] = POLLPRI
+
+        cdef Py_ssize_t nfds = len(rlist) + len(wlist) + len(xlist)
+        cdef pollfd* fds = <pollfd*>malloc((nfds + 1) * sizeof(pollfd))
+        if fds is NULL:
+            raise MemoryError
+        cdef Py_ssize_t i = 0
+        cdef int k, ret
+        result = ([], [], [])
+        try:
+            for k in range(3):
+                for f in lists[k]:
+                    fds[i].fd = fileno_of(f)
+                    fds[i].events = events[k]
+                    fds[i].revents = 0
+                    i += 1
+
+            with nogil:
+                ret = ppoll_(fds, nfds, ptv, &self.oldset)
+
+            if ret == 0:
+                return ([], [], [], True)
+            if ret < 0:
+                if libc.errno.errno == libc.errno.EINTR:
+                    return ([], [], [], False)
+                PyErr_SetFromErrno(OSError)
+
+            i = 0
+            for k in range(3):
+                for f in lists[k]:
+                    if fds[i].revents & POLLNVAL:
+                        libc.errno.errno = libc.errno.EBADF
+                        PyErr_SetFromErrno(OSError)
+                    if fds[i].revents & ready[k]:
+                        result[k].append(f)
+                    i += 1
+        finally:
+            free(fds)
+        return result + (False,)
+
     def sleep(self, timeout=None):
         """
         Wait until a signal has been received, or until ``timeout``
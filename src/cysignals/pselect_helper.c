@@ -0,0 +1,62 @@
+/*
+ * C functions for pselect.pyx
+ *
+ * Where ppoll() is available, PSelecter.pselect() uses it instead of
+ * pselect(), so that file descriptors are not limited to FD_SETSIZE.
+ * On Linux, child processes can be waited for using a pidfd (a file
+ * descriptor which becomes readable when the process exits).
+ */
+
+/*****************************************************************************
+ *       Copyright (C) 2026 The Sage Developers
+ *
+ * cysignals is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cysignals is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cysignals.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#include "config.h"
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+
+/* ppoll() if available (see HAVE_PPOLL), otherwise set errno and
+ * return -1 */
+static int ppoll_(struct pollfd* fds, nfds_t nfds,
+                  const struct timespec* timeout, const sigset_t* sigmask)
+{
+#if HAVE_PPOLL
+    return ppoll(fds, nfds, timeout, sigmask);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+
+/* Return a pidfd for the child process pid or set errno and return -1 */
+static int pidfd_open_(int pid)
+{
+#if defined(__linux__) && defined(SYS_pidfd_open)
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
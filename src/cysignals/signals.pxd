@@ -15,6 +15,7 @@
 #
 #*****************************************************************************
 
+from libc.stdint cimport uint32_t
 from cpython.object cimport PyObject
 
 cdef extern from *:
@@ -23,17 +24,88 @@ cdef extern from *:
 
 cdef extern from "struct_signals.h":
     ctypedef int cy_atomic_int
+    ctypedef Py_ssize_t cy_atomic_ssize
 
     ctypedef struct cysigs_t:
         cy_atomic_int sig_on_count
+        cy_atomic_int interrupt_received
         cy_atomic_int block_sigint
         const char* s
         PyObject* exc_value
+        const char* sig_on_file
+        int sig_on_line
+        cy_atomic_int mem_limited
+        cy_atomic_ssize mem_used
+        Py_ssize_t mem_limit
+        int mem_shrink_restart
+        int buffer_count
+        unsigned long sig_on_serial
+        int* cancel_word
+        int fptrap_excepts
+        int fptrap_active
+
+    ctypedef struct sig_trace_event_t:
+        long long time
+        unsigned long thread
+        int kind
+        int sig
+        const char* file
+        int line
+
+    enum:
+        SIG_CANCEL
+
+    enum:
+        SIG_TRACE_ENTER
+        SIG_TRACE_EXIT
+        SIG_TRACE_SIGNAL
+        SIG_TRACE_DEFER
+        SIG_TRACE_LONGJMP
+        SIG_TRACE_RAISE
+        SIG_TRACE_RECOVER
+
+    ctypedef struct sig_alloc_site_t:
+        void* site
+        unsigned long count
+        unsigned long long bytes
+
+    ctypedef struct sig_alloc_totals_t:
+        unsigned long histogram[1]
+        unsigned long frees
+        long long live
+        long long peak
+
+    enum:
+        CYSIGNALS_ALLOC_STATS
+        SIG_ALLOC_CLASSES
+        CYSIGNALS_HAVE_MEM_SIZE
+        CYSIGNALS_HAVE_FPTRAP
+        CYSIGNALS_HAVE_PROBES
+
+
+# Floating-point exceptions for sig_on_fptrap()
+cdef extern from "<fenv.h>":
+    enum:
+        FE_INVALID
+        FE_DIVBYZERO
+        FE_OVERFLOW
+        FE_UNDERFLOW
+        FE_INEXACT
+
+
+# For sig_cond_wait(), the caller must include <pthread.h>
+cdef extern from *:
+    ctypedef struct pthread_mutex_t:
+        pass
+    ctypedef struct pthread_cond_t:
+        pass
 
 
 cdef extern from "macros.h" nogil:
     int sig_on() except 0
     int sig_str(const char*) except 0
+    int sig_strf(const char*, ...) except 0
+    int sig_on_fptrap(int excepts) except 0
     int sig_check() except 0
     void sig_off()
     void sig_retry()  # Does not return
@@ -41,13 +113,21 @@ cdef extern from "macros.h" nogil:
     void sig_block()
     void sig_unblock()
 
-    # Macros behaving exactly like sig_on, sig_str and sig_check but
+    # Macros behaving exactly like sig_on, sig_str, sig_strf and sig_check but
     # which are *not* declared "except 0".  This is useful if some
     # low-level Cython code wants to do its own exception handling.
     int sig_on_no_except "sig_on"()
     int sig_str_no_except "sig_str"(const char*)
+    int sig_strf_no_except "sig_strf"(const char*, ...)
     int sig_check_no_except "sig_check"()
 
+    # Allocation functions charging the memory budget, used by the
+    # functions in memory.pxd inside global_memory_limit()
+    void* _sig_malloc_limited(size_t n)
+    void* _sig_calloc_limited(size_t nmemb, size_t size)
+    void* _sig_realloc_limited(void* ptr, size_t size)
+    void _sig_free_limited(void* ptr)
+
 # This function adds custom block/unblock/pending.
 cdef int add_custom_signals(int (*custom_signal_is_blocked)() noexcept,
                             void (*custom_signal_unblock)() noexcept,
@@ -89,17 +169,98 @@ cdef inline PyObject* sig_occurred() noexcept:
 # these available to every Cython module cimporting this file.
 cdef nogil:
     cysigs_t cysigs "cysigs"
+    int cysigs_layout_2 "cysigs_layout_2"
     void _sig_on_interrupt_received "_sig_on_interrupt_received"() noexcept
     void _sig_on_recover "_sig_on_recover"() noexcept
+    int _sig_cancel "_sig_cancel"() noexcept
+    void _sig_heartbeat "_sig_heartbeat"() noexcept
     void _do_raise_exception "_do_raise_exception"(int sig) noexcept
     void _sig_off_warning "_sig_off_warning"(const char*, int) noexcept
     void print_backtrace "print_backtrace"() noexcept
+    void _sig_trace_event "_sig_trace_event"(int kind, int sig) noexcept
+    void _sig_fptrap_enable "_sig_fptrap_enable"(int excepts) noexcept
+    void _sig_fptrap_restore "_sig_fptrap_restore"() noexcept
+
+    # Trace log, see trace.pyx
+    int sig_trace_start "sig_trace_start"(size_t capacity) noexcept
+    void sig_trace_stop "sig_trace_stop"() noexcept
+    size_t sig_trace_read "sig_trace_read"(sig_trace_event_t* out, size_t n) noexcept
+
+    # The size of an allocated block (0 if CYSIGNALS_HAVE_MEM_SIZE is 0)
+    size_t _sig_mem_size "_sig_mem_size"(void* ptr) noexcept
+
+    # Allocation statistics, see memory.pxd and memory.pyx
+    void _sig_alloc_stats_alloc "_sig_alloc_stats_alloc"(void* ptr, size_t n, size_t old) noexcept
+    void _sig_alloc_stats_free "_sig_alloc_stats_free"(size_t size) noexcept
+    size_t _sig_alloc_stats_sites "_sig_alloc_stats_sites"(sig_alloc_site_t* out, size_t n) noexcept
+    void _sig_alloc_stats_totals "_sig_alloc_stats_totals"(sig_alloc_totals_t* out) noexcept
+    void _sig_alloc_stats_reset "_sig_alloc_stats_reset"() noexcept
+
+    # Shrink callbacks called when an allocation with the check_
+    # functions from memory.pxd fails, see memory.pyx. A callback
+    # fn(n, arg) should free memory and return the number of bytes
+    # freed. sig_add_shrinker() returns -1 with errno set on failure.
+    int sig_add_shrinker "sig_add_shrinker"(size_t (*fn)(size_t n, void* arg) noexcept nogil, void* arg) noexcept
+    void sig_remove_shrinker "sig_remove_shrinker"(size_t (*fn)(size_t n, void* arg) noexcept nogil, void* arg) noexcept
+    size_t _sig_mem_shrink "_sig_mem_shrink"(size_t n) noexcept
+
+    # Storage of buffers from memory.pxd which is freed if sig_on() is
+    # interrupted, see implementation.c
+    int _sig_buffer_register "_sig_buffer_register"(void* ptr, unsigned long serial, int stats, unsigned long long* token) noexcept
+    void _sig_buffer_update "_sig_buffer_update"(int slot, unsigned long long token, void* ptr) noexcept
+    void _sig_buffer_unregister "_sig_buffer_unregister"(int slot, unsigned long long token) noexcept
+    void _sig_buffers_forget "_sig_buffers_forget"() noexcept
+    void _sig_buffers_release "_sig_buffers_release"() noexcept
+
+    # Raise the interrupt sig in the current thread if possible, used by
+    # the CPU-time alarms of alarm.pyx
+    int _sig_interrupt_thread "_sig_interrupt_thread"(int sig, int main_thread) noexcept
+
+    # Let sig_check() call fn(file, line, arg) at most every interval_ms
+    # milliseconds, with the location of the current sig_on() call
+    # (NULL and 0 outside sig_on()). A NULL fn disables the heartbeat.
+    void sig_set_heartbeat "sig_set_heartbeat"(void (*fn)(const char* file, int line, void* arg) noexcept nogil, void* arg, long interval_ms) noexcept
+
+    # Call fn(arg) inside sig_on() on a dedicated stack of stack_size
+    # bytes. An overflow of this stack raises RecursionError.
+    int sig_call_on_stack "sig_call_on_stack"(void (*fn)(void*) noexcept nogil, void* arg, size_t stack_size) except -1
+
+    # Turn a fault inside sig_on() in [addr, addr + len) into OSError
+    # mentioning the file name and the offset, see guarded_mapping.
+    # Return -1 with errno set if the mapping cannot be registered.
+    int sig_guard_mapping "sig_guard_mapping"(const void* addr, size_t len, const char* name, long long offset) noexcept
+    void sig_unguard_mapping "sig_unguard_mapping"(const void* addr) noexcept
+
+    # Reserve size bytes whose pages are filled by fill(page, offset,
+    # len, arg) when they are first accessed, see sig_lazy_alloc() in
+    # implementation.c. fill() runs in a signal handler and must be
+    # async-signal-safe. Free with sig_lazy_free().
+    void* sig_lazy_alloc "sig_lazy_alloc"(size_t size, int (*fill)(void* page, size_t offset, size_t len, void* arg) noexcept nogil, void* arg) except NULL
+    void sig_lazy_free "sig_lazy_free"(void* ptr) noexcept
+
+    # Interruptible versions of blocking system calls: outside sig_on(),
+    # an interrupt makes them raise the exception and return -1
+    Py_ssize_t sig_read "sig_read"(int fd, void* buf, size_t count) except -1
+    Py_ssize_t sig_write "sig_write"(int fd, const void* buf, size_t count) except -1
+    int sig_waitpid "sig_waitpid"(int pid, int* status, int options) except -1
+    int sig_futex_wait "sig_futex_wait"(uint32_t* addr, uint32_t val) except -1
+    int sig_futex_wake "sig_futex_wake"(uint32_t* addr, int n) except -1
+    int sig_cond_wait "sig_cond_wait"(pthread_cond_t* cond, pthread_mutex_t* mutex) except -1
 
 
 cdef inline void __generate_declarations() noexcept:
     cysigs
+    cysigs_layout_2
     _sig_on_interrupt_received
     _sig_on_recover
+    _sig_cancel
+    _sig_heartbeat
     _do_raise_exception
     _sig_off_warning
     print_backtrace
+    _sig_trace_event
+    _sig_fptrap_enable
+    _sig_fptrap_restore
+    _sig_buffers_forget
+    _sig_buffers_release
+    _sig_mem_size
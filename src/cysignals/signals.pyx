@@ -26,14 +26,17 @@ See ``tests.pyx`` for extensive tests.
 
 from libc.signal cimport *
 from libc.stdio cimport freopen, stdin
+from libc.errno cimport EFAULT
 from cpython.ref cimport Py_XINCREF, Py_CLEAR, _Py_REFCNT
 from cpython.exc cimport (PyErr_Occurred, PyErr_NormalizeException,
-        PyErr_Fetch, PyErr_Restore)
+        PyErr_Fetch, PyErr_Restore, PyErr_SetObject, PyErr_SetFromErrno)
 from cpython.version cimport PY_MAJOR_VERSION
+from cpython.buffer cimport PyObject_GetBuffer, PyBuffer_Release, PyBUF_SIMPLE
 
 cimport cython
 import sys
 from gc import collect
+from os import fsencode, fsdecode
 
 # On Windows, some signals are not pre-defined.
 # We define them here with values that will never occur in practice
@@ -44,21 +47,80 @@ cdef extern from *:
     #define NO_SUCH_SIGNAL 256
     #define SIGHUP NO_SUCH_SIGNAL
     #define SIGALRM NO_SUCH_SIGNAL
+    #define SIGVTALRM NO_SUCH_SIGNAL
     #define SIGBUS NO_SUCH_SIGNAL
     #endif
     """
     pass
 
+# With the shared library libcysignals, the cysigs object is defined in
+# the library. Cython declares cysigs as static variable of this module
+# (see signals.pxd), which becomes a pointer to the object of the
+# library by this macro.
+cdef extern from *:
+    """
+    #if CYSIGNALS_SHARED_LIBRARY
+    extern cysigs_t cysigs;
+    static cysigs_t* cysigs_ptr = &cysigs;
+    #define cysigs (*cysigs_ptr)
+    #endif
+    """
+    pass
+
+cdef extern from "struct_signals.h":
+    ctypedef struct sig_handlers_t:
+        pass
+
 cdef extern from "implementation.c":
     cysigs_t cysigs
+    int cysigs_layout_2
     int _set_debug_level(int) nogil
     void setup_alt_stack() nogil
     void setup_cysignals_handlers() nogil
+    int sig_handlers_save(sig_handlers_t* h) nogil
+    int sig_handlers_restore(const sig_handlers_t* h) nogil
     void print_backtrace() nogil
     void _sig_on_interrupt_received() nogil
+    int _sig_interrupt_thread(int sig, int main_thread) nogil
     void _sig_on_recover() nogil
+    int _sig_cancel() nogil
+    void _sig_heartbeat() nogil
+    void sig_set_heartbeat(void (*fn)(const char* file, int line, void* arg) noexcept nogil, void* arg, long interval_ms) nogil
     void _do_raise_exception(int sig) nogil
     void _sig_off_warning(const char*, int) nogil
+    void _sig_trace_event(int kind, int sig) nogil
+    void _sig_fptrap_enable(int excepts) nogil
+    void _sig_fptrap_restore() nogil
+    int sig_trace_start(size_t capacity) nogil
+    void sig_trace_stop() nogil
+    size_t sig_trace_read(sig_trace_event_t* out, size_t n) nogil
+    size_t _sig_mem_size(void* ptr) nogil
+    void _sig_alloc_stats_alloc(void* ptr, size_t n, size_t old) nogil
+    void _sig_alloc_stats_free(size_t size) nogil
+    size_t _sig_alloc_stats_sites(sig_alloc_site_t* out, size_t n) nogil
+    void _sig_alloc_stats_totals(sig_alloc_totals_t* out) nogil
+    void _sig_alloc_stats_reset() nogil
+    int sig_add_shrinker(size_t (*fn)(size_t n, void* arg) noexcept nogil, void* arg) nogil
+    void sig_remove_shrinker(size_t (*fn)(size_t n, void* arg) noexcept nogil, void* arg) nogil
+    size_t _sig_mem_shrink(size_t n) nogil
+    int _sig_buffer_register(void* ptr, unsigned long serial, int stats, unsigned long long* token) nogil
+    void _sig_buffer_update(int slot, unsigned long long token, void* ptr) nogil
+    void _sig_buffer_unregister(int slot, unsigned long long token) nogil
+    void _sig_buffers_forget() nogil
+    void _sig_buffers_release() nogil
+    int sig_call_on_stack(void (*fn)(void*) noexcept nogil, void* arg, size_t stack_size) except -1 nogil
+    int _sig_stack_overflowed() nogil
+    int sig_guard_mapping(const void* addr, size_t len, const char* name, long long offset) nogil
+    void sig_unguard_mapping(const void* addr) nogil
+    const char* _sig_fault_mapping(long long* offset) nogil
+    void* sig_lazy_alloc(size_t size, int (*fill)(void* page, size_t offset, size_t len, void* arg) noexcept nogil, void* arg) except NULL nogil
+    void sig_lazy_free(void* ptr) nogil
+    Py_ssize_t sig_read(int fd, void* buf, size_t count) except -1 nogil
+    Py_ssize_t sig_write(int fd, const void* buf, size_t count) except -1 nogil
+    int sig_waitpid(int pid, int* status, int options) except -1 nogil
+    int sig_futex_wait(uint32_t* addr, uint32_t val) except -1 nogil
+    int sig_futex_wake(uint32_t* addr, int n) except -1 nogil
+    int sig_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex) except -1 nogil
 
     # Python library functions for raising exceptions without "except"
     # clause.
@@ -139,6 +201,25 @@ class AlarmInterrupt(KeyboardInterrupt):
     pass
 
 
+class CPUAlarmInterrupt(AlarmInterrupt):
+    """
+    Exception class for :func:`~cysignals.alarm.cpu_alarm` timeouts,
+    raised for the signal ``SIGVTALRM``.
+
+    EXAMPLES::
+
+        >>> import platform, pytest
+        >>> if platform.system() == 'Windows':
+        ...     pytest.skip('this doctest does not work on Windows')
+        >>> from cysignals.signals import sig_print_exception
+        >>> import signal
+        >>> sig_print_exception(signal.SIGVTALRM)
+        cysignals.signals.CPUAlarmInterrupt
+
+    """
+    pass
+
+
 class SignalError(BaseException):
     """
     Exception class for critical signals such as ``SIGSEGV``. Inherits
@@ -155,12 +236,72 @@ class SignalError(BaseException):
     pass
 
 
-@cython.optimize.use_switch(False)
+# Exception instances raised for interrupts, indexed by exception type.
+# These are reused if nothing else references them, see raise_interrupt().
+cdef dict interrupt_instances = {}
+
+# Is cysigs.exc_value one of the instances in interrupt_instances?
+# In that case, interrupt_instances holds an additional reference to it.
+cdef bint exc_value_cached = False
+
+
+cdef int raise_interrupt(typ) except -1:
+    """
+    Raise an exception of type ``typ`` without arguments and save it in
+    ``cysigs.exc_value``. For efficiency with frequent interrupts, the
+    previously raised instance is reused if there are no references to
+    it besides ``interrupt_instances`` and ``cysigs.exc_value``.
+    """
+    global exc_value_cached
+    exc = interrupt_instances.get(typ)
+    # References: interrupt_instances, exc and maybe cysigs.exc_value
+    if exc is not None and _Py_REFCNT(<PyObject*>exc) == 2 + (<PyObject*>exc is cysigs.exc_value):
+        exc.__traceback__ = None
+        exc.__context__ = None
+        exc.__cause__ = None
+        exc.__suppress_context__ = False
+    else:
+        exc = typ()
+        interrupt_instances[typ] = exc
+    PyErr_SetObject(typ, exc)
+
+    Py_XINCREF(<PyObject*>exc)
+    Py_CLEAR(cysigs.exc_value)
+    cysigs.exc_value = <PyObject*>exc
+    exc_value_cached = True
+    return 0
+
+
 cdef int sig_raise_exception "sig_raise_exception"(int sig, const char* msg) except 0 with gil:
     """
     Raise an exception for signal number ``sig`` with message ``msg``
     (or a default message if ``msg`` is ``NULL``).
     """
+    return raise_signal_exception(sig, msg)
+
+
+@cython.optimize.use_switch(False)
+cdef bint raise_mapping_fault(const char* msg) except -1:
+    """
+    If the last fault was inside a :class:`guarded_mapping`, raise
+    ``OSError`` with the file name and the offset and return True.
+    """
+    cdef long long offset = 0
+    cdef const char* name = _sig_fault_mapping(&offset)
+    if name is NULL:
+        return False
+    err = OSError(EFAULT, f"{msg.decode()} at offset {offset}", fsdecode(<bytes>name))
+    PyErr_SetObject(OSError, err)
+    return True
+
+
+cdef int raise_signal_exception "_sig_raise_exception"(int sig, const char* msg) except 0:
+    """
+    Like :func:`sig_raise_exception`, but the caller must hold the GIL.
+    This raises the exception in the current thread state.
+    """
+    global exc_value_cached
+
     # Do not raise an exception if an exception is already pending
     if PyErr_Occurred():
         return 0
@@ -180,22 +321,37 @@ cdef int sig_raise_exception "sig_raise_exception"(int sig, const char* msg) exc
             msg = "Floating point exception"
         PyErr_SetString(FloatingPointError, msg)
     elif sig == SIGSEGV:
-        if msg is NULL:
-            msg = "Segmentation fault"
-        PyErr_SetString(SignalError, msg)
+        if _sig_stack_overflowed():
+            if msg is NULL:
+                msg = "stack overflow on dedicated stack"
+            PyErr_SetString(RecursionError, msg)
+        else:
+            if msg is NULL:
+                msg = "Segmentation fault"
+            if not raise_mapping_fault(msg):
+                PyErr_SetString(SignalError, msg)
     elif sig == SIGINT:
-        PyErr_SetNone(KeyboardInterrupt)
+        raise_interrupt(KeyboardInterrupt)
+        return 0
     elif sig == SIGTERM or sig == SIGHUP:
         # Redirect stdin from /dev/null to close interactive sessions
         _ = freopen("/dev/null", "r", stdin)
         # This causes Python to exit
         PyErr_SetNone(SystemExit)
     elif sig == SIGALRM:
-        PyErr_SetNone(AlarmInterrupt)
+        raise_interrupt(AlarmInterrupt)
+        return 0
+    elif sig == SIGVTALRM:
+        raise_interrupt(CPUAlarmInterrupt)
+        return 0
+    elif sig == SIG_CANCEL:
+        raise_interrupt(cancel_exception)
+        return 0
     elif sig == SIGBUS:
         if msg is NULL:
             msg = "Bus error"
-        PyErr_SetString(SignalError, msg)
+        if not raise_mapping_fault(msg):
+            PyErr_SetString(SignalError, msg)
     else:
         PyErr_Format(SystemError, "unknown signal number %i", sig)
 
@@ -208,6 +364,7 @@ cdef int sig_raise_exception "sig_raise_exception"(int sig, const char* msg) exc
     Py_XINCREF(val)
     Py_CLEAR(cysigs.exc_value)
     cysigs.exc_value = val
+    exc_value_cached = False
     PyErr_Restore(typ, val, tb)
 
     return 0
@@ -262,7 +419,9 @@ def init_cysignals():
     This is normally done exactly once, namely when importing
     ``cysignals``. However, it is legal to call this multiple times,
     for example when switching between the ``cysignals`` interrupt
-    handler and a different interrupt handler.
+    handler and a different interrupt handler. Only the first call
+    allocates memory, later calls only install the signal handlers.
+    To switch handlers often, :func:`save_handlers` is more convenient.
 
     OUTPUT: the old Python-level interrupt handler
 
@@ -272,6 +431,24 @@ def init_cysignals():
         >>> init_cysignals()
         <cyfunction python_check_interrupt at ...>
 
+    TESTS:
+
+    Repeated calls do not start threads or leak memory::
+
+        >>> import platform, pytest
+        >>> if platform.system() != 'Linux':
+        ...     pytest.skip('this doctest requires /proc')
+        >>> def threads_and_rss():
+        ...     with open("/proc/self/status") as f:
+        ...         status = dict(line.split(":", 1) for line in f)
+        ...     return int(status["Threads"]), int(status["VmRSS"].split()[0])
+        >>> threads, rss = threads_and_rss()
+        >>> for _ in range(10000):
+        ...     _ = init_cysignals()
+        >>> threads2, rss2 = threads_and_rss()
+        >>> threads2 == threads, rss2 - rss < 1000
+        (True, True)
+
     """
     # Set the Python-level interrupt handler. When a SIGINT occurs,
     # this will not be called directly. Instead, a SIGINT is caught by
@@ -293,6 +470,82 @@ def init_cysignals():
     return old
 
 
+cdef class SignalHandlers:
+    """
+    A snapshot of the handlers of all signals handled by ``cysignals``
+    (such as ``SIGINT``, ``SIGALRM``, ``SIGSEGV`` and ``SIGABRT``),
+    including the Python-level handler for ``SIGINT``. Create it with
+    :func:`save_handlers`.
+
+    Restoring a snapshot does not allocate memory and costs one system
+    call per signal. A snapshot can also be used as context manager,
+    which installs its handlers and restores the previous ones on exit.
+
+    EXAMPLES:
+
+    An embedding application can switch between its own handlers and
+    the handlers of ``cysignals``::
+
+        >>> import platform, pytest
+        >>> if platform.system() == 'Windows':
+        ...     pytest.skip('this doctest does not work on Windows')
+        >>> import signal
+        >>> from cysignals.signals import init_cysignals, save_handlers
+        >>> from cysignals.tests import test_dereference_null_pointer
+        >>> _ = init_cysignals()
+        >>> cy = save_handlers()
+        >>> _ = signal.signal(signal.SIGINT, signal.default_int_handler)
+        >>> host = save_handlers()
+        >>> with cy:
+        ...     test_dereference_null_pointer()
+        Traceback (most recent call last):
+        ...
+        cysignals.signals.SignalError: Segmentation fault
+        >>> signal.getsignal(signal.SIGINT)
+        <built-in function default_int_handler>
+        >>> cy.restore()
+        >>> signal.getsignal(signal.SIGINT)
+        <cyfunction python_check_interrupt at ...>
+    """
+    cdef sig_handlers_t handlers
+    cdef object python_handler
+    cdef SignalHandlers previous
+
+    def restore(self):
+        """
+        Install the handlers of this snapshot.
+        """
+        if self.python_handler is not None:
+            # This also installs the OS-level handler of Python for
+            # SIGINT, which is replaced below
+            import signal
+            signal.signal(signal.SIGINT, self.python_handler)
+        if sig_handlers_restore(&self.handlers) == -1:
+            PyErr_SetFromErrno(OSError)
+
+    def __enter__(self):
+        self.previous = save_handlers()
+        self.restore()
+        return self
+
+    def __exit__(self, *args):
+        self.previous.restore()
+        self.previous = None
+
+
+def save_handlers():
+    """
+    Return a :class:`SignalHandlers` snapshot of the current handlers
+    of the signals handled by ``cysignals``.
+    """
+    import signal
+    cdef SignalHandlers h = SignalHandlers.__new__(SignalHandlers)
+    h.python_handler = signal.getsignal(signal.SIGINT)
+    if sig_handlers_save(&h.handlers) == -1:
+        PyErr_SetFromErrno(OSError)
+    return h
+
+
 def _setup_alt_stack():
     """
     This is needed after forking on OS X because ``fork()`` disables
@@ -345,9 +598,315 @@ def sig_on_reset():
     """
     cdef int s = cysigs.sig_on_count
     cysigs.sig_on_count = 0
+    if cysigs.fptrap_active:
+        _sig_fptrap_restore()
     return s
 
 
+# Names of the floating-point exceptions for fp_trap
+fp_exceptions = {"invalid": FE_INVALID, "divide": FE_DIVBYZERO,
+                 "overflow": FE_OVERFLOW, "underflow": FE_UNDERFLOW,
+                 "inexact": FE_INEXACT}
+
+
+cdef class fp_trap:
+    """
+    Context manager enabling floating-point exceptions as traps inside
+    every ``sig_on()`` region, such that they raise
+    ``FloatingPointError`` at the faulting instruction.
+
+    Outside ``sig_on()``, the floating-point environment is not
+    changed. Python code, which relies on ``inf`` and ``nan`` results,
+    is therefore not affected. Inside the ``with`` block, every outermost
+    ``sig_on()`` behaves like ``sig_on_fptrap(excepts)`` in Cython.
+
+    INPUT:
+
+    - ``*exceptions`` -- names of floating-point exceptions among
+      ``"invalid"``, ``"divide"``, ``"overflow"``, ``"underflow"`` and
+      ``"inexact"``. By default, ``"invalid"``, ``"divide"`` and
+      ``"overflow"`` are trapped.
+
+    EXAMPLES::
+
+        >>> import platform, pytest
+        >>> if platform.system() != 'Linux':
+        ...     pytest.skip('this doctest requires feenableexcept()')
+        >>> from cysignals.signals import fp_trap
+        >>> from cysignals.tests import fp_divide
+        >>> fp_divide(1.0, 0.0)
+        inf
+        >>> with fp_trap():
+        ...     fp_divide(1.0, 0.0)
+        Traceback (most recent call last):
+        ...
+        FloatingPointError: floating-point division by zero
+        >>> with fp_trap("invalid"):
+        ...     fp_divide(1.0, 0.0)
+        inf
+        >>> with fp_trap("invalid"):
+        ...     fp_divide(0.0, 0.0)
+        Traceback (most recent call last):
+        ...
+        FloatingPointError: invalid floating-point operation
+        >>> fp_trap("bogus")
+        Traceback (most recent call last):
+        ...
+        ValueError: unknown floating-point exception 'bogus'
+    """
+    cdef int excepts
+    cdef int saved
+
+    def __init__(self, *exceptions):
+        if not CYSIGNALS_HAVE_FPTRAP:
+            raise RuntimeError("floating-point traps are not supported on this platform")
+        if not exceptions:
+            exceptions = ("invalid", "divide", "overflow")
+        self.excepts = 0
+        for name in exceptions:
+            try:
+                self.excepts |= fp_exceptions[name]
+            except KeyError:
+                raise ValueError(f"unknown floating-point exception {name!r}") from None
+
+    def __enter__(self):
+        self.saved = cysigs.fptrap_excepts
+        cysigs.fptrap_excepts = self.excepts
+        return self
+
+    def __exit__(self, *args):
+        cysigs.fptrap_excepts = self.saved
+
+
+cdef class guarded_mapping:
+    """
+    Context manager turning a ``SIGBUS`` or ``SIGSEGV`` inside
+    ``sig_on()`` at an address in the buffer ``buf`` into an
+    ``OSError`` (with ``errno`` equal to ``EFAULT``) mentioning the
+    file name and the offset in the file.
+
+    This is meant for zero-copy access to memory-mapped files: when the
+    file is truncated by another process while it is mapped, accessing
+    a page beyond the new end of the file raises ``SIGBUS``, which
+    normally raises :class:`SignalError`.
+
+    INPUT:
+
+    - ``buf`` -- an object supporting the buffer protocol, typically
+      an :class:`mmap.mmap`. It cannot be closed or resized inside the
+      ``with`` block.
+
+    - ``filename`` -- the name of the mapped file
+
+    - ``offset`` -- (default: 0) the offset in the file of the start
+      of ``buf``
+
+    EXAMPLES::
+
+        >>> import platform, pytest
+        >>> if platform.system() != 'Linux':
+        ...     pytest.skip('this doctest requires Linux')
+        >>> import mmap, tempfile
+        >>> from cysignals.signals import guarded_mapping
+        >>> from cysignals.tests import read_byte
+        >>> f = tempfile.NamedTemporaryFile()
+        >>> _ = f.write(b"x" * 2 * mmap.PAGESIZE); f.flush()
+        >>> m = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        >>> _ = f.truncate(mmap.PAGESIZE)
+        >>> read_byte(m, 0)
+        120
+        >>> with guarded_mapping(m, f.name):
+        ...     try:
+        ...         read_byte(m, mmap.PAGESIZE + 1)
+        ...     except OSError as exc:
+        ...         err = exc
+        >>> err.strerror == f"Bus error at offset {mmap.PAGESIZE + 1}"
+        True
+        >>> err.filename == f.name
+        True
+        >>> read_byte(m, mmap.PAGESIZE + 1)
+        Traceback (most recent call last):
+        ...
+        cysignals.signals.SignalError: Bus error
+        >>> m.close(); f.close()
+    """
+    cdef Py_buffer view
+    cdef bint guarded
+
+    def __init__(self, buf, filename, long long offset=0):
+        name = fsencode(filename)
+        self.release()
+        PyObject_GetBuffer(buf, &self.view, PyBUF_SIMPLE)
+        if sig_guard_mapping(self.view.buf, self.view.len, name, offset) == -1:
+            PyBuffer_Release(&self.view)
+            PyErr_SetFromErrno(OSError)
+        self.guarded = True
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.release()
+
+    def release(self):
+        """
+        Stop guarding the mapping and release the buffer. This is
+        called when leaving the ``with`` block.
+        """
+        if self.guarded:
+            self.guarded = False
+            sig_unguard_mapping(self.view.buf)
+            PyBuffer_Release(&self.view)
+
+    def __dealloc__(self):
+        self.release()
+
+
+# The exception raised when the cancellation word is set and the buffer
+# holding the word, see attach_cancel_word()
+cancel_exception = KeyboardInterrupt
+cancel_buffer = None
+
+
+def attach_cancel_word(buf, Py_ssize_t offset=0, exception=KeyboardInterrupt):
+    """
+    Let ``sig_check()`` and ``sig_on()`` handle a nonzero C ``int`` at
+    ``offset`` in the buffer ``buf`` like an interrupt which raises
+    ``exception``.
+
+    This allows another process to cancel a computation by writing to
+    shared memory, for example an :class:`mmap.mmap` of a file or an
+    anonymous mapping shared with a parent process, without sending a
+    signal. Checking the word is a plain memory access. Unlike an
+    interrupt, the word is only checked by ``sig_check()`` and
+    ``sig_on()``: computations inside ``sig_on()`` which do not call
+    ``sig_check()`` and blocking system calls are not cancelled.
+
+    The word is detached when the exception is raised, such that it is
+    raised only once. There is only one cancellation word in the
+    process, attaching a word replaces the previous one.
+
+    INPUT:
+
+    - ``buf`` -- an object supporting the buffer protocol. It cannot be
+      closed or resized until :func:`detach_cancel_word` is called.
+
+    - ``offset`` -- (default: 0) the offset of the word in ``buf``, a
+      multiple of ``sizeof(int)``
+
+    - ``exception`` -- (default: ``KeyboardInterrupt``) the exception
+      class to raise
+
+    EXAMPLES::
+
+        >>> import platform, pytest
+        >>> if platform.system() == 'Windows':
+        ...     pytest.skip('this doctest does not work on Windows')
+        >>> import mmap, os, time
+        >>> from cysignals.signals import attach_cancel_word, detach_cancel_word
+        >>> from cysignals.tests import sig_check_loop
+        >>> m = mmap.mmap(-1, mmap.PAGESIZE)  # Shared with child processes
+        >>> attach_cancel_word(m, 8, TimeoutError)
+        >>> pid = os.fork()
+        >>> if pid == 0:
+        ...     time.sleep(0.2)
+        ...     m[8] = 1  # Cancel the computation of the parent
+        ...     os._exit(0)
+        >>> try:
+        ...     sig_check_loop()
+        ... except TimeoutError:
+        ...     print("cancelled")
+        cancelled
+        >>> _ = os.waitpid(pid, 0)
+        >>> detach_cancel_word()
+        >>> m.close()
+
+    TESTS::
+
+        >>> attach_cancel_word(bytearray(8), 6)
+        Traceback (most recent call last):
+        ...
+        ValueError: offset 6 is out of range or not aligned
+        >>> attach_cancel_word(bytearray(8), 0, 42)
+        Traceback (most recent call last):
+        ...
+        TypeError: exception must be an exception class
+    """
+    global cancel_exception, cancel_buffer
+    if not (isinstance(exception, type) and issubclass(exception, BaseException)):
+        raise TypeError("exception must be an exception class")
+    view = memoryview(buf)
+    cdef Py_buffer b
+    PyObject_GetBuffer(view, &b, PyBUF_SIMPLE)
+    cdef char* word = <char*>b.buf + offset
+    cdef Py_ssize_t n = b.len
+    PyBuffer_Release(&b)
+    if offset < 0 or offset > n - <Py_ssize_t>sizeof(int) or <size_t>word % sizeof(int):
+        raise ValueError(f"offset {offset} is out of range or not aligned")
+    detach_cancel_word()
+    cancel_exception = exception
+    cancel_buffer = view
+    cysigs.cancel_word = <int*>word
+
+
+def detach_cancel_word():
+    """
+    Stop checking the cancellation word attached with
+    :func:`attach_cancel_word` (if any) and release its buffer.
+    """
+    global cancel_buffer
+    cysigs.cancel_word = NULL
+    if cancel_buffer is not None:
+        cancel_buffer.release()
+        cancel_buffer = None
+
+
+# The Python heartbeat callback, see set_heartbeat()
+heartbeat_function = None
+
+cdef void call_py_heartbeat(const char* file, int line, void* arg) noexcept with gil:
+    (<object>arg)(None if file is NULL else file.decode("utf-8", "replace"), line)
+
+
+def set_heartbeat(func, double interval=1.0):
+    """
+    Let ``sig_check()`` call ``func(file, line)`` at most every
+    ``interval`` seconds, where ``file`` and ``line`` are the location
+    of the current ``sig_on()`` call (``None`` and 0 outside
+    ``sig_on()``). If ``func`` is ``None``, the heartbeat is disabled.
+
+    This allows to monitor the liveness or progress of computations
+    which call ``sig_check()`` regularly, without a separate thread.
+    Only a cheap clock comparison is added to ``sig_check()``. The
+    callback is called with interrupts blocked by ``sig_block()`` and
+    exceptions raised by it are printed and ignored. There is only one
+    heartbeat callback in the process.
+
+    From Cython, a C function ``void fn(const char* file, int line,
+    void* arg) noexcept nogil`` can be set with
+    ``sig_set_heartbeat(fn, arg, interval_ms)``.
+
+    EXAMPLES::
+
+        >>> from cysignals.signals import set_heartbeat
+        >>> from cysignals.tests import test_heartbeat
+        >>> beats = []
+        >>> set_heartbeat(lambda file, line: beats.append((file, line)), 0.01)
+        >>> test_heartbeat(0.2)  # Call sig_check() inside sig_on()
+        >>> set_heartbeat(None)
+        >>> len(beats) >= 5
+        True
+        >>> file, line = beats[-1]
+        >>> "tests" in file, line > 0
+        (True, True)
+    """
+    global heartbeat_function
+    sig_set_heartbeat(NULL, NULL, 0)
+    heartbeat_function = func
+    if func is not None:
+        sig_set_heartbeat(call_py_heartbeat, <void*>func, <long>(interval * 1000))
+
+
 def python_check_interrupt(sig, frame):
     """
     Python-level interrupt handler for interrupts raised in Python
@@ -362,7 +921,7 @@ cdef void verify_exc_value() noexcept:
     Check that ``cysigs.exc_value`` is still the exception being raised.
     Clear ``cysigs.exc_value`` if not.
     """
-    if cysigs.exc_value != NULL and _Py_REFCNT(cysigs.exc_value) == 1:
+    if cysigs.exc_value != NULL and _Py_REFCNT(cysigs.exc_value) == 1 + exc_value_cached:
         # No other references => exception is certainly gone
         Py_CLEAR(cysigs.exc_value)
         return
@@ -410,5 +969,5 @@ cdef void verify_exc_value() noexcept:
     # Make sure we still have cysigs.exc_value at all; if this function was
     # called again during garbage collection it might have already been set
     # to NULL; see https://github.com/sagemath/cysignals/issues/126
-    if cysigs.exc_value != NULL and _Py_REFCNT(cysigs.exc_value) == 1:
+    if cysigs.exc_value != NULL and _Py_REFCNT(cysigs.exc_value) == 1 + exc_value_cached:
         Py_CLEAR(cysigs.exc_value)
@@ -0,0 +1,139 @@
+# cython: freethreading_compatible = True
+# cython: preliminary_late_includes_cy28=True
+r"""
+Stack dumps of all threads on demand
+
+This module installs a handler for a signal (by default ``SIGUSR2``)
+which prints the stacks of all threads without stopping the process.
+For every thread, the native stack is printed with the location of the
+innermost ``sig_on()`` call if the thread is inside ``sig_on()``.
+The Python stacks of all threads are printed by :mod:`faulthandler`.
+This allows to see what a process is doing, for example a computation
+which seems to hang, without a debugger and without terminating it::
+
+    kill -USR2 <pid>
+
+Only async-signal-safe functions are used, so this also works while
+threads hold locks. Native stacks of other threads than the one
+receiving the signal are only printed on Linux.
+
+EXAMPLES::
+
+    >>> import platform, pytest
+    >>> if platform.system() != 'Linux':
+    ...     pytest.skip('this doctest requires Linux')
+    >>> import os, signal, tempfile, threading, time
+    >>> from cysignals import stackdump
+    >>> from cysignals.tests import sig_on_busy_loop
+    >>> f = tempfile.TemporaryFile("w+")
+    >>> stackdump.enable(signal.SIGUSR2, f)
+    >>> t = threading.Thread(target=sig_on_busy_loop, args=(1,))
+    >>> t.start(); time.sleep(0.2)
+    >>> os.kill(os.getpid(), signal.SIGUSR2)
+    >>> t.join()
+    >>> stackdump.disable()
+    >>> _ = f.seek(0)
+    >>> out = f.read()
+    >>> out.count("Native stack of thread") >= 2
+    True
+    >>> "inside sig_on() at" in out
+    True
+    >>> "Current thread" in out  # Python stacks
+    True
+"""
+
+#*****************************************************************************
+#  cysignals is free software: you can redistribute it and/or modify it
+#  under the terms of the GNU Lesser General Public License as published
+#  by the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  cysignals is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU Lesser General Public License for more details.
+#
+#  You should have received a copy of the GNU Lesser General Public License
+#  along with cysignals.  If not, see <http://www.gnu.org/licenses/>.
+#
+#*****************************************************************************
+
+from cpython.exc cimport PyErr_SetFromErrno
+
+from .signals cimport *
+
+cdef extern from "stackdump_helper.c":
+    int stackdump_enable(int signum, int fd)
+    void stackdump_disable()
+
+import faulthandler
+import signal
+import sys
+
+
+# The signal and the file used by the current handler
+cdef object dump_signum = None
+cdef object dump_file = None
+
+
+def enable(signum=signal.SIGUSR2, file=None):
+    """
+    Print the stacks of all threads to ``file`` whenever the signal
+    ``signum`` is received.
+
+    INPUT:
+
+    - ``signum`` -- (default: ``SIGUSR2``) the signal number
+
+    - ``file`` -- (default: ``sys.stderr``) a file object with a
+      ``fileno()`` method. A reference to it is kept until
+      :func:`disable` is called.
+
+    If a handler is already installed, it is replaced.
+
+    TESTS::
+
+        >>> import platform, pytest
+        >>> if platform.system() == 'Windows':
+        ...     pytest.skip('this doctest does not work on Windows')
+        >>> from cysignals import stackdump
+        >>> stackdump.enable(0)
+        Traceback (most recent call last):
+        ...
+        OSError: [Errno 22] Invalid argument
+        >>> stackdump.enable()
+        >>> stackdump.enable()
+        >>> stackdump.disable()
+        >>> stackdump.disable()  # Calling more than once doesn't matter
+    """
+    global dump_signum, dump_file
+    if file is None:
+        file = sys.stderr
+    cdef int fd = file.fileno()
+    file.flush()
+    disable()
+    if stackdump_enable(signum, fd) == -1:
+        PyErr_SetFromErrno(OSError)
+    try:
+        # Install faulthandler on top of our handler: it prints the
+        # Python stacks and then calls our handler
+        faulthandler.register(signum, file, all_threads=True, chain=True)
+    except BaseException:
+        stackdump_disable()
+        raise
+    dump_signum = signum
+    dump_file = file
+
+
+def disable():
+    """
+    Restore the handler of the signal which was installed before
+    :func:`enable`.
+    """
+    global dump_signum, dump_file
+    if dump_signum is None:
+        return
+    faulthandler.unregister(dump_signum)
+    stackdump_disable()
+    dump_signum = None
+    dump_file = None
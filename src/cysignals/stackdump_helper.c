@@ -0,0 +1,270 @@
+/*
+ * C functions for the stack dumps in stackdump.pyx
+ *
+ * The thread receiving the dump signal prints its own native stack.
+ * On Linux, it then lists the other threads in /proc/self/task and
+ * sends the signal to each of them in turn with rt_tgsigqueueinfo(),
+ * marking it as forwarded. A thread receiving a forwarded signal
+ * prints its own stack and tells the first thread that it is done.
+ * Everything is printed with write() and backtrace_symbols_fd(), which
+ * are async-signal-safe, so this works while threads are stuck inside
+ * locks or system calls.
+ */
+
+/*****************************************************************************
+ *       Copyright (C) 2026 The Sage Developers
+ *
+ * cysignals is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * cysignals is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with cysignals.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#if HAVE_EXECINFO_H
+#include <execinfo.h>
+#endif
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+/* Dumping the other threads needs atomics and a way to signal a
+ * specific thread with a marker */
+#if CYSIGNALS_C_ATOMIC && defined(__linux__) && defined(SYS_rt_tgsigqueueinfo) && defined(SYS_getdents64)
+#define STACKDUMP_ALL_THREADS 1
+#include <stdatomic.h>
+#else
+#define STACKDUMP_ALL_THREADS 0
+#endif
+
+/* Maximal number of return addresses printed per thread */
+#define STACKDUMP_MAXDEPTH 64
+
+/* Value attached to forwarded signals */
+#define STACKDUMP_FORWARDED 0x63797364
+
+/* How long to wait for a thread to print its stack */
+#define STACKDUMP_TIMEOUT_MS 1000
+
+static int stackdump_signum;
+static int stackdump_fd = 2;
+static struct sigaction stackdump_oldaction;
+
+#if STACKDUMP_ALL_THREADS
+/* The thread which should print its stack now (0 if none) */
+static _Atomic long stackdump_target;
+/* Is a dump in progress? */
+static _Atomic int stackdump_busy;
+#endif
+
+
+static void stackdump_write(const char* s)
+{
+    if (write(stackdump_fd, s, strlen(s))) {}
+}
+
+static void stackdump_write_ulong(unsigned long n, int base)
+{
+    char buf[3 * sizeof(n) + 1];
+    char* p = buf + sizeof(buf);
+    *--p = '\0';
+    do {
+        *--p = "0123456789abcdef"[n % base];
+        n /= base;
+    } while (n);
+    if (base == 16) *--p = 'x', *--p = '0';
+    stackdump_write(p);
+}
+
+
+/* Print the native stack of the current thread. The thread is
+ * identified by pthread_self() as in the output of faulthandler. */
+static void stackdump_thread(long tid)
+{
+    stackdump_write("Native stack of thread ");
+    stackdump_write_ulong((unsigned long)pthread_self(), 16);
+    if (tid)
+    {
+        stackdump_write(" (tid ");
+        stackdump_write_ulong((unsigned long)tid, 10);
+        stackdump_write(")");
+    }
+    if (cysigs.sig_on_count > 0 && pthread_equal(pthread_self(), cysigs.owner))
+    {
+        const char* file = cysigs.sig_on_file;
+        stackdump_write(", inside sig_on() at ");
+        stackdump_write(file ? file : "?");
+        stackdump_write(":");
+        stackdump_write_ulong((unsigned long)cysigs.sig_on_line, 10);
+    }
+    stackdump_write(":\n");
+#if HAVE_BACKTRACE
+    void* pcs[STACKDUMP_MAXDEPTH];
+    int depth = backtrace(pcs, STACKDUMP_MAXDEPTH);
+    /* Skip this function and the signal handler */
+    if (depth > 2) backtrace_symbols_fd(pcs + 2, depth - 2, stackdump_fd);
+#else
+    stackdump_write("(backtrace not available)\n");
+#endif
+    stackdump_write("\n");
+}
+
+
+#if STACKDUMP_ALL_THREADS
+static long stackdump_gettid(void)
+{
+    return (long)syscall(SYS_gettid);
+}
+
+/* Send the forwarded dump signal to thread ``tid`` and wait until it
+ * printed its stack. */
+static void stackdump_other_thread(long tid)
+{
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+    info.si_signo = stackdump_signum;
+    info.si_code = SI_QUEUE;
+    info.si_pid = getpid();
+    info.si_uid = getuid();
+    info.si_value.sival_int = STACKDUMP_FORWARDED;
+
+    atomic_store(&stackdump_target, tid);
+    if (syscall(SYS_rt_tgsigqueueinfo, getpid(), tid, stackdump_signum, &info) == 0)
+    {
+        struct timespec ts = {0, 1000000};
+        int ms;
+        for (ms = 0; ms < STACKDUMP_TIMEOUT_MS; ms++)
+        {
+            if (atomic_load(&stackdump_target) != tid) return;
+            nanosleep(&ts, NULL);
+        }
+    }
+
+    /* A thread blocking the signal never answers. If it answers too
+     * late, it sees that it is no longer the target and prints
+     * nothing. */
+    long expected = tid;
+    if (atomic_compare_exchange_strong(&stackdump_target, &expected, 0))
+    {
+        stackdump_write("Native stack of thread with tid ");
+        stackdump_write_ulong((unsigned long)tid, 10);
+        stackdump_write(" not available (signal blocked?)\n\n");
+    }
+}
+
+/* Dump all threads except the current one, listed in /proc/self/task */
+static void stackdump_other_threads(long self)
+{
+    char buf[1024];
+    int fd = open("/proc/self/task", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) return;
+
+    for (;;)
+    {
+        long n = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+        if (n <= 0) break;
+        long pos = 0;
+        while (pos < n)
+        {
+            /* struct linux_dirent64: ino (8), off (8), reclen (2),
+             * type (1), name */
+            unsigned short reclen;
+            memcpy(&reclen, buf + pos + 16, sizeof(reclen));
+            const char* name = buf + pos + 19;
+            pos += reclen;
+
+            long tid = 0;
+            if (*name < '0' || *name > '9') continue;
+            for (; *name >= '0' && *name <= '9'; name++)
+                tid = 10 * tid + (*name - '0');
+            if (tid != self) stackdump_other_thread(tid);
+        }
+    }
+    close(fd);
+}
+#endif
+
+
+static void stackdump_handler(CYTHON_UNUSED int sig, siginfo_t* info, CYTHON_UNUSED void* context)
+{
+    int saved_errno = errno;
+#if STACKDUMP_ALL_THREADS
+    long tid = stackdump_gettid();
+    if (info && info->si_code == SI_QUEUE &&
+        info->si_value.sival_int == STACKDUMP_FORWARDED)
+    {
+        /* Forwarded by the thread which received the signal first */
+        if (atomic_load(&stackdump_target) == tid)
+        {
+            stackdump_thread(tid);
+            atomic_store(&stackdump_target, 0);
+        }
+        goto out;
+    }
+
+    /* Ignore the signal if a dump is already in progress */
+    int expected = 0;
+    if (!atomic_compare_exchange_strong(&stackdump_busy, &expected, 1))
+        goto out;
+    stackdump_thread(tid);
+    stackdump_other_threads(tid);
+    atomic_store(&stackdump_busy, 0);
+out:
+#else
+    (void)info;
+    stackdump_thread(0);
+#endif
+    errno = saved_errno;
+}
+
+
+/* Install the handler dumping the stacks to ``fd`` on signal
+ * ``signum``. Return 0 on success, -1 with errno set on failure. */
+static int stackdump_enable(int signum, int fd)
+{
+    struct sigaction sa;
+
+    if (stackdump_signum) {errno = EBUSY; return -1;}
+
+#if HAVE_BACKTRACE
+    /* Make sure that backtrace() does not need to allocate memory
+     * (to load libgcc) when it is first called by the handler. */
+    void* dummy[2];
+    backtrace(dummy, 2);
+#endif
+
+    stackdump_fd = fd;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = stackdump_handler;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(signum, &sa, &stackdump_oldaction)) return -1;
+    stackdump_signum = signum;
+    return 0;
+}
+
+
+/* Restore the previous handler */
+static void stackdump_disable(void)
+{
+    if (!stackdump_signum) return;
+    sigaction(stackdump_signum, &stackdump_oldaction, NULL);
+    stackdump_signum = 0;
+}
@@ -26,6 +26,9 @@
 #include <setjmp.h>
 #include <signal.h>
 #include <Python.h>
+#if !defined(_WIN32)
+#include <sys/types.h>  /* pthread_t */
+#endif
 
 
 /* Choose sigjmp/longjmp variant */
@@ -45,22 +48,94 @@
 #if CYSIGNALS_STD_ATOMIC
 #include <atomic>
 typedef volatile std::atomic<int> cy_atomic_int;
+typedef volatile std::atomic<Py_ssize_t> cy_atomic_ssize;
 #elif CYSIGNALS_CXX_ATOMIC
 typedef volatile _Atomic int cy_atomic_int;
+typedef volatile _Atomic Py_ssize_t cy_atomic_ssize;
 #else
 /* The type sig_atomic_t is not really atomic, but it's the best we have */
 typedef volatile sig_atomic_t cy_atomic_int;
+typedef volatile Py_ssize_t cy_atomic_ssize;
 #endif
 #else
 #if CYSIGNALS_C_ATOMIC
 typedef volatile _Atomic int cy_atomic_int;
+typedef volatile _Atomic Py_ssize_t cy_atomic_ssize;
 #else
 /* The type sig_atomic_t is not really atomic, but it's the best we have */
 typedef volatile sig_atomic_t cy_atomic_int;
+typedef volatile Py_ssize_t cy_atomic_ssize;
+#endif
+#endif
+
+
+/* Whether _sig_mem_size() (see implementation.c) can determine the
+ * size of an allocated block, needed for memory budgets and allocation
+ * statistics */
+#if HAVE_MALLOC_USABLE_SIZE || HAVE_MALLOC_SIZE || defined(_WIN32)
+#define CYSIGNALS_HAVE_MEM_SIZE 1
+#else
+#define CYSIGNALS_HAVE_MEM_SIZE 0
 #endif
+
+
+/* Floating-point traps, see sig_on_fptrap() */
+#if HAVE_FEENABLEEXCEPT
+#define CYSIGNALS_HAVE_FPTRAP 1
+#else
+#define CYSIGNALS_HAVE_FPTRAP 0
 #endif
 
 
+/* Static probes for tracing tools such as bpftrace, perf and SystemTap,
+ * see sys/sdt.h. A probe is a single nop instruction together with an
+ * ELF note describing where to find its arguments, so it costs nothing
+ * unless a tracer is attached. Since this header is also included by
+ * modules using cysignals, sys/sdt.h is looked up when compiling each
+ * module; without it (or with CYSIGNALS_HAVE_PROBES defined to 0),
+ * probes are omitted. The arguments must be plain integers or
+ * pointers. */
+#ifndef CYSIGNALS_HAVE_PROBES
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define CYSIGNALS_HAVE_PROBES 1
+#endif
+#endif
+#endif
+#ifndef CYSIGNALS_HAVE_PROBES
+#define CYSIGNALS_HAVE_PROBES 0
+#endif
+
+#if CYSIGNALS_HAVE_PROBES
+#include <sys/sdt.h>
+#define cysignals_probe0(name)  DTRACE_PROBE(cysignals, name)
+#define cysignals_probe2(name, a, b)  DTRACE_PROBE2(cysignals, name, a, b)
+#define cysignals_probe3(name, a, b, c)  DTRACE_PROBE3(cysignals, name, a, b, c)
+#else
+#define cysignals_probe0(name)
+#define cysignals_probe2(name, a, b)
+#define cysignals_probe3(name, a, b, c)
+#endif
+
+
+/* Maximal number of arguments of sig_strf() */
+#define SIG_STRF_MAXARGS 4
+
+
+/* A heartbeat callback, called by sig_check() with the location of
+ * the sig_on() call (NULL and 0 outside sig_on()) */
+typedef void (*sig_heartbeat_fn)(const char* file, int line, void* arg);
+
+
+/* Version of the layout of cysigs_t. Modules compiled against this
+ * header import the variable cysigs_layout_<version> from
+ * cysignals.signals (see signals.pxd), so they fail to import with an
+ * older cysignals instead of accessing fields beyond the end of its
+ * cysigs. Modules compiled against an older layout keep working,
+ * since new fields are appended. */
+#define CYSIGNALS_LAYOUT_VERSION 2
+
+
 /* All the state of the signal handler is in this struct. */
 typedef struct
 {
@@ -72,8 +147,8 @@ typedef struct
      * signal (e.g. SIGINT) which happened during a time when it could
      * not be handled.  This may be set when an interrupt occurs either
      * outside of sig_on() or inside sig_block().  To avoid race
-     * conditions, this value may only be changed when all
-     * interrupt-like signals are masked. */
+     * conditions, this value may only be changed by the signal
+     * handlers or atomically when sig_on_count is zero. */
     cy_atomic_int interrupt_received;
 
     /* Are we currently handling a signal inside cysigs_signal_handler()?
@@ -104,6 +179,157 @@ typedef struct
 #if ENABLE_DEBUG_CYSIGNALS
     int debug_level;
 #endif
+
+    /* The fields above are those of layout version 1. New fields are
+     * only ever appended below, bumping CYSIGNALS_LAYOUT_VERSION. */
+
+#if !defined(_WIN32)
+    /* The thread which called the outermost sig_on(). This is only
+     * meaningful while sig_on_count is positive. */
+    pthread_t owner;
+#endif
+
+    /* If this is nonzero, s is a format string set by sig_strf(),
+     * which is formatted with the arguments s_args only when an
+     * exception is raised. */
+    int s_format;
+    long s_args[SIG_STRF_MAXARGS];
+
+    /* Floating-point exceptions (FE_INVALID and so on) which are
+     * enabled as traps by every outermost sig_on(), see fp_trap. */
+    int fptrap_excepts;
+
+    /* Nonzero if floating-point traps are enabled in the current
+     * sig_on() region. In that case, the floating-point environment
+     * saved by _sig_fptrap_enable() is restored at the end of the
+     * region. */
+    int fptrap_active;
+
+    /* Source file and line of the most recent sig_on() or sig_str()
+     * call, as passed to _sig_on_prejmp(). This is informational only,
+     * it is used to attribute profiler samples to sig_on() sites. */
+    const char* sig_on_file;
+    int sig_on_line;
+
+    /* If nonzero, signal-related events are recorded in the trace log
+     * by _sig_trace_event(). See trace.pyx. */
+    cy_atomic_int trace_enabled;
+
+    /* Memory budget for the allocation functions from memory.pxd, see
+     * global_memory_limit in memory.pyx. If mem_limited is nonzero,
+     * mem_used is the number of bytes allocated minus the number of
+     * bytes freed by these functions in all threads and allocations
+     * fail if mem_used would exceed mem_limit. */
+    cy_atomic_int mem_limited;
+    cy_atomic_ssize mem_used;
+    Py_ssize_t mem_limit;
+
+    /* If nonzero, an allocation with the check_ functions from
+     * memory.pxd which failed inside sig_on() restarts the sig_on()
+     * block with sig_retry() after the shrink callbacks freed memory,
+     * see restart_after_shrink in memory.pyx. */
+    int mem_shrink_restart;
+
+    /* Number of buffers from memory.pxd whose storage is freed if the
+     * outermost sig_on() block is interrupted, see implementation.c */
+    int buffer_count;
+
+    /* Incremented by every outermost sig_on(), to identify the
+     * sig_on() block to which a buffer belongs */
+    unsigned long sig_on_serial;
+
+    /* If not NULL, a word (typically in shared memory) polled by
+     * sig_check() and sig_on(): a nonzero value is handled like an
+     * interrupt, see attach_cancel_word() in signals.pyx */
+    volatile int* cancel_word;
+
+    /* If not NULL, sig_check() calls heartbeat_fn(file, line,
+     * heartbeat_arg) at most every heartbeat_interval nanoseconds (of
+     * CLOCK_MONOTONIC), see sig_set_heartbeat() in implementation.c.
+     * heartbeat_next is the earliest time of the next call. */
+    sig_heartbeat_fn heartbeat_fn;
+    void* heartbeat_arg;
+    long long heartbeat_interval;
+    long long heartbeat_next;
 } cysigs_t;
 
+
+/* Pseudo signal number passed to sig_raise_exception() for a
+ * cancellation through cysigs.cancel_word */
+#define SIG_CANCEL 0x10000
+
+
+/* Kinds of events in the trace log */
+#define SIG_TRACE_ENTER    1  /* Outermost sig_on() */
+#define SIG_TRACE_EXIT     2  /* Outermost sig_off() */
+#define SIG_TRACE_SIGNAL   3  /* A signal handler was called */
+#define SIG_TRACE_DEFER    4  /* An interrupt could not be handled immediately */
+#define SIG_TRACE_LONGJMP  5  /* A signal handler jumps back to sig_on() */
+#define SIG_TRACE_RAISE    6  /* A Python exception is raised for a signal */
+#define SIG_TRACE_RECOVER  7  /* Cleanup after an exception in sig_on() */
+
+/* One event in the trace log */
+typedef struct
+{
+    /* Time from CLOCK_MONOTONIC in nanoseconds */
+    long long time;
+    /* Thread (on Linux, the kernel thread id) which recorded the event */
+    unsigned long thread;
+    /* One of the SIG_TRACE_ constants above */
+    int kind;
+    /* Signal number, or 0 if the event does not concern a signal */
+    int sig;
+    /* Location of the most recent sig_on() call at the time of the event */
+    const char* file;
+    int line;
+} sig_trace_event_t;
+
+
+/* Allocation statistics, see alloc_stats() in memory.pyx. These are
+ * recorded by the functions from memory.pxd in modules compiled with
+ * CYSIGNALS_ALLOC_STATS defined to 1. */
+#ifndef CYSIGNALS_ALLOC_STATS
+#define CYSIGNALS_ALLOC_STATS 0
+#endif
+
+/* Number of size classes: class k contains the sizes n with
+ * 2^(k-1) <= n < 2^k, class 0 contains only n = 0 */
+#define SIG_ALLOC_CLASSES 65
+
+/* Allocations from one call site (in one thread) */
+typedef struct
+{
+    /* Return address of the call to the allocation function, or NULL
+     * for call sites which did not fit in the table */
+    void* site;
+    unsigned long count;
+    unsigned long long bytes;
+} sig_alloc_site_t;
+
+/* Totals over all call sites and threads */
+typedef struct
+{
+    unsigned long histogram[SIG_ALLOC_CLASSES];
+    unsigned long frees;
+    /* Bytes currently allocated (as reported by malloc_usable_size()
+     * or equivalent) and the maximum of that */
+    long long live;
+    long long peak;
+} sig_alloc_totals_t;
+
+
+/* The handlers of all signals handled by cysignals, see
+ * sig_handlers_save() in implementation.c. Only the first
+ * CYSIGS_NSIGNALS entries are used. */
+#define SIG_HANDLERS_MAX 16
+
+typedef struct
+{
+#if defined(_WIN32)
+    void (*handler[SIG_HANDLERS_MAX])(int);
+#else
+    struct sigaction action[SIG_HANDLERS_MAX];
+#endif
+} sig_handlers_t;
+
 #endif  /* ifndef CYSIGNALS_STRUCT_SIGNALS_H */
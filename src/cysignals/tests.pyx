@@ -29,10 +29,22 @@ We disable crash debugging for this test run::
 #
 #*****************************************************************************
 
+# Record allocation statistics, see cysignals.memory. This must come
+# before the cysignals headers.
+cdef extern from *:
+    """
+    #define CYSIGNALS_ALLOC_STATS 1
+    """
+
+cimport cython
 from libc.signal cimport (SIGHUP, SIGINT, SIGABRT, SIGILL, SIGSEGV,
-        SIGFPE, SIGBUS, SIGQUIT)
+        SIGFPE, SIGBUS, SIGQUIT, SIGALRM, raise_)
 from libc.stdlib cimport abort
+from libc.stdint cimport uint32_t
+from posix.unistd cimport pipe, close
+from posix.fcntl cimport fcntl, F_DUPFD
 from libc.errno cimport errno
+from libc.time cimport clock, clock_t, CLOCKS_PER_SEC
 from posix.signal cimport sigaltstack, stack_t, SS_ONSTACK
 
 from cpython cimport PyErr_SetString
@@ -45,6 +57,11 @@ cdef extern from "tests_helper.c" nogil:
     void ms_sleep(long ms)
     void signal_after_delay(int signum, long ms)
     void signals_after_delay(int signum, long ms, long interval, int n)
+    void signals_after_us(int signum, long us, long interval, int n)
+    void signals_to_thread_after_us(long tid, int signum, long us, long interval, int n)
+    long current_thread_id()
+    long long monotonic_ns()
+    long long last_signal_sent_ns()
     void* map_noreserve()
     int unmap_noreserve(void* addr)
 
@@ -56,6 +73,13 @@ cdef extern from "<pthread.h>" nogil:
     int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
                        void *(*start_routine) (void *), void *arg)
     int pthread_join(pthread_t thread, void **retval)
+    int pthread_mutex_init(pthread_mutex_t* mutex, const void* attr)
+    int pthread_mutex_lock(pthread_mutex_t* mutex)
+    int pthread_mutex_trylock(pthread_mutex_t* mutex)
+    int pthread_mutex_unlock(pthread_mutex_t* mutex)
+    int pthread_mutex_destroy(pthread_mutex_t* mutex)
+    int pthread_cond_init(pthread_cond_t* cond, const void* attr)
+    int pthread_cond_destroy(pthread_cond_t* cond)
 
 
 cdef extern from *:
@@ -66,10 +90,11 @@ cdef extern from *:
     #endif
     """
     ctypedef int volatile_int "volatile int"
+    ctypedef long volatile_long "volatile long"
 
 
 # Default delay in milliseconds before raising signals
-cdef long DEFAULT_DELAY = 200
+cdef long DEFAULT_DELAY = 20
 
 
 import sys
@@ -192,6 +217,14 @@ def on_stack():
     return on_alt_stack()
 
 
+def have_probes():
+    """
+    Was this module compiled with the static tracing probes (which
+    requires ``sys/sdt.h``)? See ``tests/test_probes.py``.
+    """
+    return bool(CYSIGNALS_HAVE_PROBES)
+
+
 def _sig_on():
     """
     A single ``sig_on()`` for doctesting purposes. This can never work
@@ -200,6 +233,28 @@ def _sig_on():
     sig_on()
 
 
+def sig_on_busy_loop(double seconds):
+    """
+    Keep the CPU busy inside ``sig_on()`` for ``seconds`` seconds of
+    CPU time. This is used to test the profiler.
+    """
+    cdef clock_t end = clock() + <clock_t>(seconds * CLOCKS_PER_SEC)
+    with nogil:
+        sig_on()
+        while clock() < end:
+            pass
+        sig_off()
+
+
+def sig_check_loop():
+    """
+    Call ``sig_check()`` until an exception is raised.
+    """
+    while True:
+        with nogil:
+            sig_check()
+
+
 def subpython_err(command, **kwds):
     """
     Run ``command`` in a Python subprocess and print the standard error
@@ -259,6 +314,110 @@ def test_sig_str(long delay=DEFAULT_DELAY):
         signal_after_delay(SIGABRT, delay)
         infinite_loop()
 
+def test_sig_strf(long delay=DEFAULT_DELAY):
+    """
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> test_sig_strf()
+        Traceback (most recent call last):
+        ...
+        RuntimeError: multiplying 3 x 4 by 4 x 5 matrices
+
+    """
+    cdef int n = 3, m = 4, k = 5
+    with nogil:
+        sig_strf("multiplying %ld x %ld by %ld x %ld matrices", n, m, m, k)
+        signal_after_delay(SIGABRT, delay)
+        infinite_loop()
+
+def test_sig_strf_invalid(long delay=DEFAULT_DELAY):
+    """
+    A format with other conversions than ``%ld`` and friends is not
+    formatted.
+
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> test_sig_strf_invalid()
+        Traceback (most recent call last):
+        ...
+        RuntimeError: %d items and %s
+
+    """
+    cdef long n = 3
+    with nogil:
+        sig_strf("%d items and %s", n)
+        signal_after_delay(SIGABRT, delay)
+        infinite_loop()
+
+def test_sig_strf_no_args(long delay=DEFAULT_DELAY):
+    """
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> test_sig_strf_no_args()
+        Traceback (most recent call last):
+        ...
+        RuntimeError: 100% ok
+
+    """
+    with nogil:
+        sig_strf("100%% ok")
+        signal_after_delay(SIGABRT, delay)
+        infinite_loop()
+
+def test_sig_on_fptrap(double x=1e300):
+    """
+    TESTS::
+
+        >>> import platform, pytest
+        >>> if platform.system() != 'Linux':
+        ...     pytest.skip('this doctest requires feenableexcept()')
+        >>> from cysignals.tests import *
+        >>> test_sig_on_fptrap()
+        Traceback (most recent call last):
+        ...
+        FloatingPointError: floating-point overflow
+        >>> test_sig_on_fptrap(2.0)
+        4.0
+        >>> 1e300 * 1e300  # Traps are disabled after sig_off()
+        inf
+
+    """
+    cdef double y
+    with nogil:
+        sig_on_fptrap(FE_INVALID | FE_DIVBYZERO | FE_OVERFLOW)
+        y = x * x
+        sig_off()
+    return y
+
+@cython.cdivision(True)
+def fp_divide(double x, double y):
+    """
+    Compute ``x / y`` inside ``sig_on()``. This is used to test
+    :class:`cysignals.signals.fp_trap`.
+    """
+    cdef double r
+    sig_on()
+    r = x / y
+    sig_off()
+    return r
+
+def read_byte(buf, Py_ssize_t i):
+    """
+    Read the byte at index ``i`` of ``buf`` inside ``sig_on()``,
+    without bounds checking. This is used to test
+    :class:`cysignals.signals.guarded_mapping`.
+    """
+    cdef const unsigned char[:] view = buf
+    cdef const unsigned char* p = &view[0]
+    cdef int r
+    sig_on()
+    r = p[i]
+    sig_off()
+    return r
+
 cdef c_test_sig_on_cython():
     sig_on()
     infinite_loop()
@@ -344,6 +503,82 @@ def test_sig_check_inside_sig_on(long delay=DEFAULT_DELAY):
             sig_check()
 
 
+def test_heartbeat(double seconds):
+    """
+    Call ``sig_check()`` inside ``sig_on()`` for ``seconds`` seconds of
+    CPU time, see :func:`cysignals.signals.set_heartbeat`.
+    """
+    cdef clock_t end = clock() + <clock_t>(seconds * CLOCKS_PER_SEC)
+    with nogil:
+        sig_on()
+        while clock() < end:
+            sig_check()
+        sig_off()
+
+@return_exception
+def test_cancel_word(bint inside_sig_on=False):
+    """
+    Set the cancellation word after 1000 calls of ``sig_check()``,
+    inside or outside ``sig_on()``.
+
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> test_cancel_word()
+        TimeoutError()
+        >>> test_cancel_word(True)
+        TimeoutError()
+
+    """
+    from .signals import attach_cancel_word, detach_cancel_word
+    cdef int word = 0
+    cdef long i = 0
+    attach_cancel_word(<int[:1]>&word, 0, TimeoutError)
+    try:
+        with nogil:
+            if inside_sig_on:
+                sig_on()
+            while True:
+                sig_check()
+                i += 1
+                if i == 1000:
+                    (<volatile_int*>&word)[0] = 1
+    finally:
+        detach_cancel_word()
+
+def test_cancel_word_sig_on():
+    """
+    Call ``sig_on()`` with a nonzero cancellation word, which raises
+    the exception. Since the word is detached, ``sig_check()`` does not
+    raise it again.
+
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> test_cancel_word_sig_on()
+        KeyboardInterrupt()
+        'not raised again'
+
+    """
+    from .signals import attach_cancel_word, detach_cancel_word
+    cdef int word = 1
+    attach_cancel_word(<int[:1]>&word)
+    try:
+        try:
+            with nogil:
+                sig_on()
+                sig_off()
+        except KeyboardInterrupt as exc:
+            print(repr(exc))
+        with nogil:
+            sig_check()
+            sig_on()
+            sig_off()
+        return 'not raised again'
+    finally:
+        detach_cancel_word()
+
+
 ########################################################################
 # Test sig_retry() and sig_error()                                     #
 ########################################################################
@@ -699,6 +934,386 @@ def unguarded_stack_overflow():
         stack_overflow()
 
 
+cdef long deep_recursion(long depth) noexcept nogil:
+    # About 512 bytes of stack per call
+    cdef volatile_int buf[128]
+    buf[depth % 128] = 1
+    if depth <= 0:
+        return 0
+    return deep_recursion(depth - 1) + buf[depth % 128]
+
+cdef void deep_recursion_kernel(void* data) noexcept nogil:
+    cdef long* depth = <long*>data
+    depth[0] = deep_recursion(depth[0])
+
+cdef void stack_overflow_kernel(void* data) noexcept nogil:
+    stack_overflow()
+
+cdef void deep_infinite_loop_kernel(void* data) noexcept nogil:
+    deep_recursion(10000)
+    infinite_loop()
+
+def test_call_on_stack(long depth, size_t stack_size):
+    """
+    Recurse ``depth`` times on a dedicated stack of ``stack_size``
+    bytes, using about 512 bytes of stack per call.
+
+    TESTS:
+
+    This is much deeper than the default stack of 8 MiB allows::
+
+        >>> from cysignals.tests import *
+        >>> test_call_on_stack(10**5, 2**28)
+        100000
+        >>> test_call_on_stack(10**5, 2**20)
+        Traceback (most recent call last):
+        ...
+        RecursionError: stack overflow on dedicated stack
+        >>> test_call_on_stack(10, 2**20)
+        10
+
+    """
+    with nogil:
+        sig_call_on_stack(deep_recursion_kernel, &depth, stack_size)
+    return depth
+
+def test_stack_overflow_on_stack():
+    """
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> test_stack_overflow_on_stack()
+        Traceback (most recent call last):
+        ...
+        RecursionError: stack overflow on dedicated stack
+
+    This also works in a thread without an alternate signal stack::
+
+        >>> import threading
+        >>> def run():
+        ...     try:
+        ...         test_stack_overflow_on_stack()
+        ...     except RecursionError as e:
+        ...         print(e)
+        >>> t = threading.Thread(target=run); t.start(); t.join()
+        stack overflow on dedicated stack
+
+    Outside of the dedicated stack, this is still a segmentation fault::
+
+        >>> test_stack_overflow()
+        Traceback (most recent call last):
+        ...
+        cysignals.signals.SignalError: Segmentation fault
+
+    """
+    with nogil:
+        sig_call_on_stack(stack_overflow_kernel, NULL, 1 << 24)
+
+@return_exception
+def test_interrupt_on_stack(long delay=DEFAULT_DELAY):
+    """
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> test_interrupt_on_stack()
+        KeyboardInterrupt()
+        >>> test_call_on_stack(100, 2**20)
+        100
+
+    """
+    with nogil:
+        signal_after_delay(SIGINT, delay)
+        sig_call_on_stack(deep_infinite_loop_kernel, NULL, 1 << 24)
+
+
+########################################################################
+# Test lazy regions                                                    #
+########################################################################
+cdef int fill_range(void* page, size_t offset, size_t length, void* arg) noexcept nogil:
+    # arg points to the number of filled pages and the number of a
+    # page which cannot be filled
+    cdef long* state = <long*>arg
+    cdef long* p = <long*>page
+    cdef size_t i
+    if <long>(offset // length) == state[1]:
+        return -1
+    state[0] += 1
+    for i in range(length // sizeof(long)):
+        p[i] = offset // sizeof(long) + i
+    return 0
+
+def test_sig_lazy_alloc(size_t n, size_t step, long fail_page=-1):
+    """
+    Sum every ``step``-th entry of a lazy region of ``n`` longs where
+    entry ``i`` is ``i``. Return the sum and the number of pages which
+    were filled. Filling page ``fail_page`` fails.
+
+    TESTS::
+
+        >>> import platform, pytest
+        >>> if platform.system() == 'Windows':
+        ...     pytest.skip('this doctest does not work on Windows')
+        >>> import mmap
+        >>> from cysignals.tests import *
+        >>> test_sig_lazy_alloc(2**20, 2**16) == (sum(range(0, 2**20, 2**16)), 16)
+        True
+        >>> test_sig_lazy_alloc(2**20, 1)[0] == sum(range(2**20))
+        True
+        >>> test_sig_lazy_alloc(2**20, 2**16, 2**16 // (mmap.PAGESIZE // 8))
+        Traceback (most recent call last):
+        ...
+        cysignals.signals.SignalError: failed to fill a page of a lazy region
+
+    """
+    cdef long state[2]
+    state[0] = 0
+    state[1] = fail_page
+    cdef long* a = <long*>sig_lazy_alloc(n * sizeof(long), fill_range, state)
+    cdef long s = 0
+    cdef size_t i = 0
+    try:
+        sig_on()
+        while i < n:
+            s += a[i]
+            i += step
+        sig_off()
+    finally:
+        sig_lazy_free(a)
+    return s, state[0]
+
+# State shared by fill_slowly() and lazy_reader()
+ctypedef struct lazy_race:
+    long* region
+    size_t n
+    volatile_int filling
+    volatile_long first
+    volatile_long seen
+
+cdef int fill_slowly(void* page, size_t offset, size_t length, void* arg) noexcept nogil:
+    # Fill the first half of the page, give lazy_reader() time to read
+    # the page, then fill the second half
+    cdef lazy_race* st = <lazy_race*>arg
+    cdef long* p = <long*>page
+    cdef size_t i, n = length // sizeof(long)
+    for i in range(n // 2):
+        p[i] = i + 1
+    st.filling = 1
+    ms_sleep(50)
+    for i in range(n // 2, n):
+        p[i] = i + 1
+    return 0
+
+cdef void* lazy_reader(void* arg) noexcept nogil:
+    cdef lazy_race* st = <lazy_race*>arg
+    while not st.filling:
+        pass
+    st.seen = st.region[st.n - 1]
+    return NULL
+
+def test_sig_lazy_race(size_t pagesize):
+    """
+    Read the first entry of a lazy region of one page, such that the
+    page is filled, while another thread reads the last entry of the
+    page. Return the entry seen by the other thread and the value of
+    that entry in the filled page.
+
+    TESTS::
+
+        >>> import platform, pytest
+        >>> if platform.system() == 'Windows':
+        ...     pytest.skip('this doctest does not work on Windows')
+        >>> import mmap
+        >>> from cysignals.tests import *
+        >>> seen, expected = test_sig_lazy_race(mmap.PAGESIZE)
+        >>> seen == expected
+        True
+
+    """
+    cdef lazy_race st
+    st.n = pagesize // sizeof(long)
+    st.filling = 0
+    st.seen = -1
+    st.region = <long*>sig_lazy_alloc(pagesize, fill_slowly, &st)
+    cdef pthread_t thread = 0
+    try:
+        with nogil:
+            if pthread_create(&thread, NULL, lazy_reader, &st):
+                with gil:
+                    raise OSError("pthread_create() failed")
+            st.first = st.region[0]
+            pthread_join(thread, NULL)
+    finally:
+        sig_lazy_free(st.region)
+    return st.seen, st.n
+
+
+########################################################################
+# Test interruptible blocking calls                                    #
+########################################################################
+@return_exception
+def test_sig_read(long delay=DEFAULT_DELAY):
+    """
+    Read from an empty pipe until interrupted.
+
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> test_sig_read()
+        KeyboardInterrupt()
+
+    """
+    cdef int fds[2]
+    cdef char buf[16]
+    if pipe(fds) == -1:
+        raise OSError(errno, "pipe() failed")
+    try:
+        with nogil:
+            signal_after_delay(SIGINT, delay)
+            sig_read(fds[0], buf, sizeof(buf))
+    finally:
+        close(fds[0])
+        close(fds[1])
+
+def test_sig_read_write(bytes data, int min_fd=0):
+    """
+    Write ``data`` to a pipe and read it back. The file descriptors of
+    the pipe are at least ``min_fd``.
+
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> test_sig_read_write(b"cysignals")
+        b'cysignals'
+
+    File descriptors above ``FD_SETSIZE`` work where ``ppoll()`` is
+    available::
+
+        >>> import platform, pytest, resource
+        >>> if platform.system() != 'Linux':
+        ...     pytest.skip('this doctest requires ppoll()')
+        >>> soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+        >>> if hard != resource.RLIM_INFINITY and hard < 2048:
+        ...     pytest.skip('not enough file descriptors')
+        >>> resource.setrlimit(resource.RLIMIT_NOFILE, (2048, hard))
+        >>> test_sig_read_write(b"cysignals", 1500)
+        b'cysignals'
+        >>> resource.setrlimit(resource.RLIMIT_NOFILE, (soft, hard))
+
+    """
+    cdef int fds[2]
+    cdef char buf[64]
+    cdef const char* s = data
+    cdef Py_ssize_t n = min(len(data), <Py_ssize_t>sizeof(buf))
+    cdef int i, fd
+    if pipe(fds) == -1:
+        raise OSError(errno, "pipe() failed")
+    if min_fd:
+        for i in range(2):
+            fd = fcntl(fds[i], F_DUPFD, min_fd)
+            close(fds[i])
+            if fd == -1:
+                close(fds[1 - i])
+                raise OSError(errno, "fcntl() failed")
+            fds[i] = fd
+    try:
+        with nogil:
+            n = sig_write(fds[1], s, n)
+            n = sig_read(fds[0], buf, n)
+    finally:
+        close(fds[0])
+        close(fds[1])
+    return buf[:n]
+
+@return_exception
+def test_sig_waitpid(long delay=DEFAULT_DELAY):
+    """
+    Wait for a child process until interrupted.
+
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> test_sig_waitpid()
+        KeyboardInterrupt()
+        >>> test_sig_waitpid(0)  # No interrupt
+        7
+
+    """
+    if delay:
+        p = Popen([sys.executable, "-c", "import time; time.sleep(30)"])
+    else:
+        p = Popen([sys.executable, "-c", "raise SystemExit(7)"])
+    cdef int pid = p.pid
+    cdef int status = 0
+    try:
+        with nogil:
+            if delay:
+                signal_after_delay(SIGINT, delay)
+            sig_waitpid(pid, &status, 0)
+    except BaseException:
+        p.kill()
+        p.wait()
+        raise
+    return (status >> 8) & 0xff
+
+@return_exception
+def test_sig_futex_wait(long delay=DEFAULT_DELAY):
+    """
+    Wait on a futex until interrupted.
+
+    TESTS::
+
+        >>> import platform, pytest
+        >>> if platform.system() != 'Linux':
+        ...     pytest.skip('this doctest requires futexes')
+        >>> from cysignals.tests import *
+        >>> test_sig_futex_wait()
+        KeyboardInterrupt()
+
+    """
+    cdef uint32_t word = 0
+    with nogil:
+        # This returns immediately since the value differs
+        sig_futex_wait(&word, 1)
+        signal_after_delay(SIGINT, delay)
+        while word == 0:
+            sig_futex_wait(&word, 0)
+
+@return_exception
+def test_sig_cond_wait(long delay=DEFAULT_DELAY):
+    """
+    Wait on a condition variable until interrupted, then check that
+    the mutex is locked.
+
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> test_sig_cond_wait()
+        KeyboardInterrupt()
+        >>> test_sig_cond_wait()
+        KeyboardInterrupt()
+
+    """
+    cdef pthread_mutex_t mutex
+    cdef pthread_cond_t cond
+    pthread_mutex_init(&mutex, NULL)
+    pthread_cond_init(&cond, NULL)
+    cdef bint done = False
+    try:
+        with nogil:
+            pthread_mutex_lock(&mutex)
+            try:
+                signal_after_delay(SIGINT, delay)
+                while not done:
+                    sig_cond_wait(&cond, &mutex)
+            finally:
+                if pthread_mutex_trylock(&mutex) == 0:
+                    abort()  # The mutex was not locked
+                pthread_mutex_unlock(&mutex)
+    finally:
+        pthread_cond_destroy(&cond)
+        pthread_mutex_destroy(&mutex)
+
+
 def test_access_mmap_noreserve():
     """
     TESTS:
@@ -783,8 +1398,8 @@ def test_sig_on_inside_try(long delay=DEFAULT_DELAY):
 
 def test_interrupt_bomb(long n=100, long p=10):
     """
-    Have `p` processes each sending `n` interrupts in very quick
-    succession and see what happens :-)
+    Send `p` series of `n` interrupts in very quick succession and see
+    what happens :-)
 
     TESTS::
 
@@ -798,7 +1413,7 @@ def test_interrupt_bomb(long n=100, long p=10):
     """
     cdef long i
 
-    # Spawn p processes, each sending n signals with an interval of 1 millisecond
+    # Schedule p series of n signals with an interval of 1 millisecond
     cdef long base_delay = DEFAULT_DELAY + 5*p
     for i in range(p):
         signals_after_delay(SIGINT, base_delay, 1, n)
@@ -819,6 +1434,181 @@ def test_interrupt_bomb(long n=100, long p=10):
     print(f"Received {i}/{n*p} interrupts")
 
 
+def test_interrupt_latency(long us=1000):
+    """
+    Send ``SIGINT`` after ``us`` microseconds while running an infinite
+    loop inside ``sig_on()``. Return the time in microseconds from
+    sending the signal until the ``KeyboardInterrupt`` is caught.
+
+    TESTS::
+
+        >>> import platform, pytest
+        >>> if platform.system() != 'Linux':
+        ...     pytest.skip('the send time is only known on Linux')
+        >>> from cysignals.tests import *
+        >>> 0 < test_interrupt_latency() < 100000
+        True
+
+    """
+    cdef long long caught = 0
+    try:
+        with nogil:
+            signals_after_us(SIGINT, us, 0, 1)
+            sig_on()
+            infinite_loop()
+    except KeyboardInterrupt:
+        caught = monotonic_ns()
+    return (caught - last_signal_sent_ns()) / 1000.0
+
+
+# State of test_signal_races()
+ctypedef struct race_state:
+    unsigned long long rng
+    volatile_int retries
+    volatile_int stop
+
+# A helper thread of test_signal_races()
+ctypedef struct race_thread:
+    race_state* st
+    pthread_t thread
+    volatile_long tid
+
+cdef enum:
+    RACE_MAX_THREADS = 16
+
+cdef inline unsigned long race_random(race_state* st, unsigned long n) noexcept nogil:
+    """
+    Return a pseudo-random number in ``[0, n)`` (xorshift64)
+    """
+    st.rng ^= st.rng << 13
+    st.rng ^= st.rng >> 7
+    st.rng ^= st.rng << 17
+    return st.rng % n
+
+cdef void race_busy(race_state* st) noexcept nogil:
+    cdef volatile_int x = 0
+    cdef unsigned long n = race_random(st, 2000)
+    while n:
+        x = x + 1
+        n -= 1
+
+cdef int race_sequence(race_state* st) except 0 nogil:
+    """
+    Run a random sequence of nested ``sig_on()``, ``sig_block()``,
+    ``sig_check()`` and ``sig_retry()`` inside ``sig_on()``.
+    """
+    cdef unsigned long nops, op
+    st.retries = 0
+    sig_on()
+    nops = race_random(st, 8)
+    while nops:
+        nops -= 1
+        op = race_random(st, 5)
+        if op == 0:
+            sig_on()
+            race_busy(st)
+            sig_off()
+        elif op == 1:
+            sig_block()
+            race_busy(st)
+            sig_unblock()
+        elif op == 2:
+            sig_check()
+        elif op == 3 and st.retries < 2:
+            st.retries = st.retries + 1
+            sig_retry()
+        else:
+            race_busy(st)
+    sig_off()
+    return 1
+
+cdef void* race_helper(void* arg) noexcept nogil:
+    # Wait for signals which are forwarded to the thread inside sig_on()
+    cdef race_thread* rt = <race_thread*>arg
+    rt.tid = current_thread_id()
+    while not rt.st.stop:
+        ms_sleep(1)
+    return NULL
+
+def test_signal_races(long iterations=1000, int threads=2, unsigned long long seed=1):
+    """
+    Send ``SIGINT`` or ``SIGALRM`` at a random time between 0 and 200
+    microseconds to the current thread or to one of ``threads`` helper
+    threads (which forward it), while running a random sequence of
+    nested ``sig_on()``, ``sig_block()``, ``sig_check()`` and
+    ``sig_retry()``. Repeat this ``iterations`` times.
+
+    Every signal must raise exactly one exception of the right type and
+    the state of cysignals must be clean afterwards. Otherwise, an
+    ``AssertionError`` naming the ``seed`` and the iteration is raised.
+
+    TESTS::
+
+        >>> import platform, pytest
+        >>> if platform.system() != 'Linux':
+        ...     pytest.skip('signals can only be sent to a thread on Linux')
+        >>> from cysignals.tests import *
+        >>> test_signal_races()
+        >>> test_signal_races(500, threads=0, seed=42)
+
+    """
+    from .signals import AlarmInterrupt
+
+    if not 0 <= threads <= RACE_MAX_THREADS:
+        raise ValueError(f"threads must be between 0 and {RACE_MAX_THREADS}")
+    cdef race_state st
+    st.rng = seed or 1  # xorshift needs a nonzero state
+    st.stop = 0
+
+    cdef race_thread helpers[RACE_MAX_THREADS]
+    cdef int i, started = 0
+    cdef long self_tid = current_thread_id()
+    cdef long it, tid, us
+    cdef int sig
+    cdef long long deadline
+    try:
+        while started < threads:
+            helpers[started].st = &st
+            helpers[started].tid = 0
+            if pthread_create(&helpers[started].thread, NULL, race_helper, &helpers[started]):
+                raise OSError("pthread_create() failed")
+            started += 1
+        for i in range(threads):
+            while not helpers[i].tid:
+                ms_sleep(1)
+
+        for it in range(iterations):
+            sig = SIGINT if race_random(&st, 2) else SIGALRM
+            if threads and race_random(&st, 2):
+                tid = helpers[race_random(&st, threads)].tid
+            else:
+                tid = self_tid
+            us = race_random(&st, 200)
+            expected = KeyboardInterrupt if sig == SIGINT else AlarmInterrupt
+            try:
+                with nogil:
+                    signals_to_thread_after_us(tid, sig, us, 0, 1)
+                    race_sequence(&st)
+                    # The signal arrived after sig_off(): wait for it
+                    deadline = monotonic_ns() + 1000000000
+                    while not cysigs.interrupt_received and monotonic_ns() < deadline:
+                        pass
+                    sig_check()
+                raise AssertionError(f"seed {seed}, iteration {it}: signal {sig} lost")
+            except KeyboardInterrupt as e:
+                if type(e) is not expected:
+                    raise AssertionError(f"seed {seed}, iteration {it}: {e!r} raised for signal {sig}")
+            if cysigs.sig_on_count or cysigs.block_sigint or cysigs.interrupt_received:
+                raise AssertionError(f"seed {seed}, iteration {it}: "
+                    f"sig_on_count={cysigs.sig_on_count}, "
+                    f"block_sigint={cysigs.block_sigint}, "
+                    f"interrupt_received={cysigs.interrupt_received}")
+    finally:
+        st.stop = 1
+        for i in range(started):
+            pthread_join(helpers[i].thread, NULL)
+
+
 # Special thanks to Robert Bradshaw for suggesting the try/finally
 # construction. -- Jeroen Demeyer
 def test_try_finally_signal(long delay=DEFAULT_DELAY):
@@ -1152,6 +1942,215 @@ def test_signal_during_malloc(long delay=DEFAULT_DELAY):
         pass
 
 
+def test_memory_limit(size_t n, long count):
+    """
+    Allocate ``count`` blocks of ``n`` bytes with ``check_malloc()``,
+    then free them. This is meant to be called inside
+    :class:`cysignals.memory.global_memory_limit`.
+
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> test_memory_limit(1000, 10)
+
+    """
+    cdef void** blocks = <void**>check_calloc(count, sizeof(void*))
+    cdef long i
+    try:
+        for i in range(count):
+            blocks[i] = check_malloc(n)
+    finally:
+        for i in range(count):
+            sig_free(blocks[i])
+        sig_free(blocks)
+
+cdef class MemoryBlock:
+    """
+    A block of ``size`` bytes allocated with ``check_malloc()``, which
+    is freed when this object is deleted.
+    """
+    cdef void* ptr
+    cdef readonly size_t size
+
+    def __cinit__(self, size_t size):
+        self.ptr = check_malloc(size)
+        self.size = size
+
+    def __dealloc__(self):
+        sig_free(self.ptr)
+
+def test_sig_buffer(long n):
+    """
+    Append ``0, ..., n-1`` and then ``-1, -2, -3`` to a buffer and
+    return its items as list, after moving them out of the buffer.
+
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> test_sig_buffer(0)
+        [-1, -2, -3]
+        >>> test_sig_buffer(2)  # Only inline storage
+        [0, 1, -1, -2, -3]
+        >>> test_sig_buffer(10**5) == list(range(10**5)) + [-1, -2, -3]
+        True
+
+    """
+    cdef long extra[3]
+    extra[:] = [-1, -2, -3]
+    cdef sig_buffer buf
+    cdef long i
+    sig_buffer_init(&buf, sizeof(long))
+    for i in range(n):
+        (<long*>sig_buffer_push(&buf))[0] = i
+    sig_buffer_extend(&buf, extra, 3)
+    cdef long size = buf.size
+    cdef long* items = <long*>sig_buffer_release(&buf)
+    try:
+        return [items[i] for i in range(size)]
+    finally:
+        sig_free(items)
+
+def test_sig_buffer_empty_items(long n):
+    """
+    Append ``n`` items of 0 bytes to a buffer and return its size.
+
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> test_sig_buffer_empty_items(1000)
+        1000
+
+    """
+    cdef sig_buffer buf
+    sig_buffer_init(&buf, 0)
+    for _ in range(n):
+        sig_buffer_push(&buf)
+    cdef long size = buf.size
+    sig_buffer_free(&buf)
+    return size
+
+def test_sig_buffer_extend_overflow():
+    """
+    Extend a nonempty buffer by a number of items whose total does not
+    fit in a ``size_t``.
+
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> import sys
+        >>> try:
+        ...     test_sig_buffer_extend_overflow()
+        ... except MemoryError as e:
+        ...     print(str(e) == "failed to allocate 1 + %s items" % (2 * sys.maxsize + 1))
+        True
+
+    """
+    cdef sig_buffer buf
+    cdef long item = 0
+    sig_buffer_init(&buf, sizeof(long))
+    try:
+        sig_buffer_extend(&buf, &item, 1)
+        sig_buffer_extend(&buf, &item, <size_t>-1)
+    finally:
+        sig_buffer_free(&buf)
+
+@return_exception
+def test_sig_buffer_interrupt(long delay=DEFAULT_DELAY):
+    """
+    Fill a buffer inside ``sig_on()`` and wait for an interrupt. The
+    memory of the buffer is freed.
+
+    TESTS::
+
+        >>> import platform, pytest
+        >>> if platform.system() == 'Windows':
+        ...     pytest.skip('memory limits are not supported on Windows')
+        >>> from cysignals.tests import *
+        >>> from cysignals.memory import global_memory_limit
+        >>> with global_memory_limit(10**7) as m:
+        ...     test_sig_buffer_interrupt()
+        ...     m.used
+        KeyboardInterrupt()
+        0
+
+    """
+    cdef sig_buffer buf
+    cdef long i
+    with nogil:
+        sig_on()
+        sig_buffer_init(&buf, sizeof(long))
+        for i in range(10**5):
+            (<long*>sig_buffer_push(&buf))[0] = i
+        signal_after_delay(SIGINT, delay)
+        infinite_loop()
+
+def test_sig_buffer_retry():
+    """
+    Fill a buffer inside ``sig_on()`` and restart the block three times
+    with ``sig_retry()``. Return the final number of items.
+
+    TESTS::
+
+        >>> import platform, pytest
+        >>> if platform.system() == 'Windows':
+        ...     pytest.skip('memory limits are not supported on Windows')
+        >>> from cysignals.tests import *
+        >>> from cysignals.memory import global_memory_limit
+        >>> with global_memory_limit(10**7) as m:
+        ...     test_sig_buffer_retry()
+        ...     m.used
+        10000
+        0
+
+    The released buffers are counted as freed by :func:`alloc_stats`::
+
+        >>> from cysignals.memory import alloc_stats
+        >>> live = alloc_stats()["live"]
+        >>> test_sig_buffer_retry()
+        10000
+        >>> alloc_stats()["live"] - live
+        0
+
+    """
+    cdef sig_buffer buf
+    cdef volatile_int passes = 0
+    cdef long i
+    cdef size_t size
+    with nogil:
+        sig_on()
+        sig_buffer_init(&buf, sizeof(long))
+        for i in range(10**4):
+            (<long*>sig_buffer_push(&buf))[0] = i
+        if passes < 3:
+            passes = passes + 1
+            sig_retry()
+        size = buf.size
+        sig_buffer_free(&buf)
+        sig_off()
+    return size
+
+def test_shrink_restart(size_t n):
+    """
+    Allocate ``n`` bytes with ``check_malloc()`` inside ``sig_on()``
+    and return how many times the ``sig_on()`` block was entered. See
+    :class:`cysignals.memory.restart_after_shrink`.
+
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> test_shrink_restart(1000)
+        1
+
+    """
+    cdef volatile_int passes = 0
+    sig_on()
+    passes = passes + 1
+    cdef void* ptr = check_malloc(n)
+    sig_off()
+    sig_free(ptr)
+    return passes
+
+
 ########################################################################
 # Benchmarking functions                                               #
 ########################################################################
@@ -1184,6 +2183,32 @@ def sig_check_bench():
         for _ in range(1000000):
             sig_check()
 
+def interrupt_bench(long n=100000):
+    """
+    Raise ``SIGALRM`` inside ``sig_on()`` and handle the resulting
+    ``AlarmInterrupt`` ``n`` times. Return the number of interrupts
+    handled per second.
+
+    TESTS::
+
+        >>> from cysignals.tests import *
+        >>> interrupt_bench(1000) > 0
+        True
+
+    """
+    from time import perf_counter
+    from .signals import AlarmInterrupt
+    t = perf_counter()
+    for _ in range(n):
+        try:
+            with nogil:
+                sig_on()
+                raise_(SIGALRM)
+                sig_off()
+        except AlarmInterrupt:
+            pass
+    return n / (perf_counter() - t)
+
 
 ########################################################################
 # Test SIGHUP                                                          #
@@ -1299,6 +2324,75 @@ def test_thread_sig_block(long delay=DEFAULT_DELAY):
         sig_off()
 
 
+def test_interrupt_thread(long delay=DEFAULT_DELAY):
+    """
+    Interrupt ``sig_on()`` in a thread which is not the main thread.
+    The signal is sent to the main thread and forwarded to the thread
+    inside ``sig_on()``.
+
+    TESTS::
+
+        >>> import platform, pytest
+        >>> if platform.system() != 'Linux':
+        ...     pytest.skip('signals can only be sent to a thread on Linux')
+        >>> from cysignals.tests import *
+        >>> test_interrupt_thread()
+        KeyboardInterrupt()
+
+    """
+    import threading
+    result = []
+    def run():
+        try:
+            with nogil:
+                sig_on()
+                infinite_loop()
+        except KeyboardInterrupt as e:
+            result.append(e)
+    t = threading.Thread(target=run)
+    t.start()
+    # Wait until the thread is inside sig_on(), then signal this thread
+    while cysigs.sig_on_count == 0:
+        ms_sleep(1)
+    signals_to_thread_after_us(current_thread_id(), SIGINT, 1000 * delay, 0, 1)
+    t.join()
+    return result[0]
+
+
+def test_subinterpreter():
+    """
+    The state of cysignals (the pending exception, the interrupt state
+    and the handler of ``SIGINT``) is global to the process, so
+    :mod:`cysignals.signals` cannot be imported in a subinterpreter.
+
+    TESTS::
+
+        >>> import platform, sys, pytest
+        >>> if platform.system() == 'Windows':
+        ...     pytest.skip('this doctest does not work on Windows')
+        >>> if sys.version_info < (3, 12):
+        ...     pytest.skip('this doctest requires Python 3.12 or later')
+        >>> _ = pytest.importorskip('_xxsubinterpreters')
+        >>> from cysignals.tests import *
+        >>> test_subinterpreter()
+
+    """
+    import _xxsubinterpreters as interpreters
+    # The subinterpreter must share the GIL with the main interpreter
+    interp = interpreters.create(isolated=False)
+    try:
+        interpreters.run_string(interp, """if True:
+            try:
+                import cysignals.signals
+            except ImportError:
+                pass
+            else:
+                raise AssertionError("cysignals.signals imported in a subinterpreter")
+            """)
+    finally:
+        interpreters.destroy(interp)
+
+
 cdef void* func_thread_sig_block(void* ignored) noexcept with gil:
     # This is executed by the two threads spawned by test_thread_sig_block()
     for _ in range(1000000):
@@ -43,6 +43,22 @@
 #if HAVE_WINDOWS_H
 #include <windows.h>
 #endif
+#include <time.h>
+
+/* Signals are sent by a helper thread, see signals_after_us() */
+#if defined(__linux__) && HAVE_SYS_TIMERFD_H
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#if defined(SYS_tgkill) && defined(SYS_gettid)
+#define SIGNAL_INJECTOR 1
+#endif
+#endif
+#ifndef SIGNAL_INJECTOR
+#define SIGNAL_INJECTOR 0
+#endif
 
 
 static int on_alt_stack(void)
@@ -98,6 +114,153 @@ static int unmap_noreserve(void* addr) {
 #endif
 
 
+/* Time of CLOCK_MONOTONIC in nanoseconds */
+static long long monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+#if SIGNAL_INJECTOR
+/* The signal injector
+ *
+ * A helper thread, started by the first scheduled signal, sends the
+ * scheduled signals to the process with kill() or to a given thread
+ * with tgkill(). It waits on a timerfd armed with the earliest
+ * deadline, so signals are sent with microsecond precision and without
+ * creating processes. The helper thread blocks all signals, so a
+ * signal sent to the process is delivered to one of the other
+ * threads, as with the fork() implementation below. */
+#define INJECTIONS_MAX 64
+
+typedef struct
+{
+    int signum;
+    int n;           /* Number of signals left to send, 0 if unused */
+    pid_t tid;       /* Thread to signal, 0 for the process */
+    long long next;  /* Time of the next signal */
+    long long interval;
+} injection_t;
+
+static injection_t injections[INJECTIONS_MAX];
+static pthread_mutex_t injector_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t injector_once = PTHREAD_ONCE_INIT;
+static int injector_fd = -1;
+/* The process in which the helper thread runs */
+static pid_t injector_pid;
+/* Time just before sending the most recent signal */
+static volatile long long injector_last_sent;
+
+/* Arm the timer for the earliest scheduled signal, with the lock held */
+static void injector_arm(void)
+{
+    struct itimerspec its;
+    long long next = 0;
+    int i;
+    for (i = 0; i < INJECTIONS_MAX; i++)
+        if (injections[i].n && (!next || injections[i].next < next))
+            next = injections[i].next;
+
+    memset(&its, 0, sizeof(its));
+    if (next)
+    {
+        its.it_value.tv_sec = next / 1000000000LL;
+        its.it_value.tv_nsec = next % 1000000000LL;
+    }
+    timerfd_settime(injector_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void* injector_main(CYTHON_UNUSED void* arg)
+{
+    int fd = injector_fd;
+    for (;;)
+    {
+        uint64_t expirations;
+        if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EINTR)
+            return NULL;
+
+        pthread_mutex_lock(&injector_lock);
+        long long now = monotonic_ns();
+        int i;
+        for (i = 0; i < INJECTIONS_MAX; i++)
+        {
+            injection_t* inj = &injections[i];
+            if (!inj->n || inj->next > now) continue;
+            injector_last_sent = monotonic_ns();
+            if (inj->tid)
+                syscall(SYS_tgkill, injector_pid, inj->tid, inj->signum);
+            else
+                kill(injector_pid, inj->signum);
+            if (--inj->n) inj->next += inj->interval;
+        }
+        injector_arm();
+        pthread_mutex_unlock(&injector_lock);
+    }
+}
+
+/* In a child process created by fork(), the table and the lock are
+ * copied from the parent (possibly while the lock was held), but the
+ * helper thread is gone: start from scratch. This runs before any
+ * other thread exists in the child. */
+static void injector_atfork_child(void)
+{
+    pthread_mutex_init(&injector_lock, NULL);
+    memset(injections, 0, sizeof(injections));
+    if (injector_fd != -1) close(injector_fd);
+    injector_fd = -1;
+    injector_pid = 0;
+    static const pthread_once_t once = PTHREAD_ONCE_INIT;
+    injector_once = once;
+}
+
+static void injector_init(void)
+{
+    static int atfork_registered;
+    if (!atfork_registered)
+    {
+        pthread_atfork(NULL, NULL, injector_atfork_child);
+        atfork_registered = 1;
+    }
+
+    injector_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (injector_fd == -1) {perror("timerfd_create"); exit(1);}
+    injector_pid = getpid();
+
+    sigset_t all, old;
+    pthread_t thread;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int err = pthread_create(&thread, NULL, injector_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err) {errno = err; perror("pthread_create"); exit(1);}
+    pthread_detach(thread);
+}
+
+/* Start the helper thread if it is not running in this process. This
+ * is done only once, even if several threads call it at the same
+ * time. */
+static void injector_start(void)
+{
+    pthread_once(&injector_once, injector_init);
+}
+#endif
+
+
+/* Return the time (see monotonic_ns()) just before the most recent
+ * signal from signals_after_us() was sent, or 0 if this is unknown */
+static long long last_signal_sent_ns(void)
+{
+#if SIGNAL_INJECTOR
+    return injector_last_sent;
+#else
+    return 0;
+#endif
+}
+
+
+#if !SIGNAL_INJECTOR
 /* Signal the running process with signal ``signum`` after ``ms``
  * milliseconds.  Wait ``interval`` milliseconds, then signal again.
  * Repeat this until ``n`` signals have been sent.
@@ -174,6 +337,67 @@ static void signals_after_delay(int signum, long ms, long interval, int n)
     waitpid(child1, &wait_status, 0);
 #endif
 }
+#endif
+
+
+/* Return an identifier of the current thread for
+ * signals_to_thread_after_us(): on Linux, the kernel thread id */
+static long current_thread_id(void)
+{
+#if SIGNAL_INJECTOR
+    return (long)syscall(SYS_gettid);
+#else
+    return 0;
+#endif
+}
+
+
+/* Signal the thread ``tid`` (see current_thread_id()) with signal
+ * ``signum`` after ``us`` microseconds.  Wait ``interval``
+ * microseconds, then signal again.  Repeat this until ``n`` signals
+ * have been sent.  If ``tid`` is 0, the whole process is signalled.
+ * Without the signal injector, the whole process is always signalled
+ * and the times are rounded up to milliseconds. */
+static void signals_to_thread_after_us(long tid, int signum, long us, long interval, int n)
+{
+#if SIGNAL_INJECTOR
+    int i;
+    injector_start();
+    pthread_mutex_lock(&injector_lock);
+    for (i = 0; i < INJECTIONS_MAX; i++)
+    {
+        injection_t* inj = &injections[i];
+        if (inj->n) continue;
+        inj->signum = signum;
+        inj->tid = (pid_t)tid;
+        inj->next = monotonic_ns() + 1000LL * us;
+        inj->interval = 1000LL * interval;
+        inj->n = n;
+        break;
+    }
+    if (i == INJECTIONS_MAX) {fprintf(stderr, "too many scheduled signals\n"); abort();}
+    injector_arm();
+    pthread_mutex_unlock(&injector_lock);
+#else
+    /* Round up to milliseconds */
+    (void)tid;
+    signals_after_delay(signum, (us + 999) / 1000, (interval + 999) / 1000, n);
+#endif
+}
+
+/* Signal the process, see signals_to_thread_after_us() */
+static void signals_after_us(int signum, long us, long interval, int n)
+{
+    signals_to_thread_after_us(0, signum, us, interval, n);
+}
+
+#if SIGNAL_INJECTOR
+/* Like signals_after_us() with times in milliseconds */
+static void signals_after_delay(int signum, long ms, long interval, int n)
+{
+    signals_after_us(signum, 1000 * ms, 1000 * interval, n);
+}
+#endif
 
 /* Send just one signal */
 #define signal_after_delay(signum, ms) signals_after_delay(signum, ms, 0, 1)
@@ -0,0 +1,232 @@
+# cython: freethreading_compatible = True
+# cython: preliminary_late_includes_cy28=True
+r"""
+Timeline trace of signal handling
+
+This module records a timeline of what cysignals does: entering and
+leaving ``sig_on()`` regions, signals arriving, interrupts which are
+deferred (outside ``sig_on()`` or inside ``sig_block()``), the jump
+back to ``sig_on()``, raising the Python exception and the cleanup
+afterwards. Every event has a timestamp and the id of the thread which
+recorded it. The timeline can be exported in the Chrome trace event
+format, which can be loaded in ``chrome://tracing`` or Perfetto.
+
+Events are recorded in a preallocated ring buffer keeping the most
+recent events, from the signal handlers as well as from ``sig_on()``
+and ``sig_off()``. Recording is async-signal-safe. When tracing is
+not enabled, the only cost is checking a flag in the outermost
+``sig_on()`` and ``sig_off()``.
+
+EXAMPLES::
+
+    >>> import platform, pytest
+    >>> if platform.system() == 'Windows':
+    ...     pytest.skip('this doctest does not work on Windows')
+    >>> from cysignals import trace
+    >>> from cysignals.tests import test_sig_block
+    >>> trace.start()
+    >>> test_sig_block()
+    42
+    >>> trace.stop()
+    >>> events = trace.events()
+    >>> for time, thread, kind, sig, file, line in events:
+    ...     print(kind, sig)
+    enter 0
+    signal 2
+    defer 2
+    signal 2
+    longjmp 2
+    raise 2
+    recover 0
+    >>> "tests" in events[0][4]
+    True
+    >>> import json
+    >>> chrome = json.loads(trace.chrome_trace(events))
+    >>> [ev["ph"] for ev in chrome["traceEvents"]]
+    ['B', 'i', 'i', 'i', 'i', 'i', 'E']
+    >>> chrome["traceEvents"][1]["name"]
+    'signal SIGINT'
+"""
+
+#*****************************************************************************
+#  cysignals is free software: you can redistribute it and/or modify it
+#  under the terms of the GNU Lesser General Public License as published
+#  by the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  cysignals is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU Lesser General Public License for more details.
+#
+#  You should have received a copy of the GNU Lesser General Public License
+#  along with cysignals.  If not, see <http://www.gnu.org/licenses/>.
+#
+#*****************************************************************************
+
+from libc.stdlib cimport malloc, free
+from cpython.exc cimport PyErr_SetFromErrno
+
+from .signals cimport *
+
+import json
+import os
+import signal
+
+
+cdef dict kind_names = {
+    SIG_TRACE_ENTER: "enter",
+    SIG_TRACE_EXIT: "exit",
+    SIG_TRACE_SIGNAL: "signal",
+    SIG_TRACE_DEFER: "defer",
+    SIG_TRACE_LONGJMP: "longjmp",
+    SIG_TRACE_RAISE: "raise",
+    SIG_TRACE_RECOVER: "recover",
+}
+
+# Capacity requested in the last call to start()
+cdef size_t trace_capacity = 0
+
+
+def start(size_t buffer_size=65536):
+    """
+    Clear the trace log and start recording events.
+
+    INPUT:
+
+    - ``buffer_size`` -- (default: 65536) the number of events to keep.
+      When more events are recorded, the oldest ones are discarded.
+
+    TESTS::
+
+        >>> import platform, pytest
+        >>> if platform.system() == 'Windows':
+        ...     pytest.skip('this doctest does not work on Windows')
+        >>> from cysignals import trace
+        >>> trace.start(16)
+        >>> trace.start()
+        Traceback (most recent call last):
+        ...
+        OSError: [Errno 16] Device or resource busy
+        >>> trace.stop()
+        >>> trace.stop()  # Calling more than once doesn't matter
+        >>> trace.events()
+        []
+        >>> trace.start(0)
+        Traceback (most recent call last):
+        ...
+        OSError: [Errno 22] Invalid argument
+
+    A larger buffer replaces the previous one::
+
+        >>> trace.start(1024)
+        >>> trace.stop()
+        >>> trace.events()
+        []
+    """
+    global trace_capacity
+    if sig_trace_start(buffer_size) == -1:
+        PyErr_SetFromErrno(OSError)
+    trace_capacity = buffer_size
+
+
+def stop():
+    """
+    Stop recording events. The events recorded so far remain available
+    to :func:`events`.
+    """
+    sig_trace_stop()
+
+
+def events():
+    """
+    Return the events in the trace log, oldest first.
+
+    OUTPUT: a list of tuples ``(time, thread, kind, sig, file, line)``
+    where
+
+    - ``time`` is the time of the event in nanoseconds, measured with
+      the monotonic clock (the same clock as :func:`time.monotonic_ns`)
+
+    - ``thread`` is the id of the thread which recorded the event (on
+      Linux, this is the kernel thread id, see :func:`threading.get_native_id`)
+
+    - ``kind`` is one of ``"enter"``, ``"exit"`` (the outermost
+      ``sig_on()`` and ``sig_off()``), ``"signal"`` (a signal handler
+      was called), ``"defer"`` (an interrupt could not be handled
+      immediately), ``"longjmp"`` (the signal handler jumps back to
+      ``sig_on()``), ``"raise"`` (a Python exception is raised for a
+      signal) or ``"recover"`` (the ``sig_on()`` region was left
+      because of an exception)
+
+    - ``sig`` is the signal number or 0
+
+    - ``file`` and ``line`` give the location of the most recent call
+      of ``sig_on()`` at the time of the event
+    """
+    if not trace_capacity:
+        return []
+    cdef sig_trace_event_t* buf = <sig_trace_event_t*>malloc(trace_capacity * sizeof(sig_trace_event_t))
+    if buf is NULL:
+        raise MemoryError
+    cdef size_t n, i
+    result = []
+    try:
+        n = sig_trace_read(buf, trace_capacity)
+        for i in range(n):
+            file = buf[i].file.decode("utf-8", "replace") if buf[i].file else "?"
+            result.append((buf[i].time, buf[i].thread, kind_names.get(buf[i].kind),
+                           buf[i].sig, file, buf[i].line))
+    finally:
+        free(buf)
+    return result
+
+
+cdef signal_name(int sig):
+    try:
+        return signal.Signals(sig).name
+    except ValueError:
+        return str(sig)
+
+
+def chrome_trace(log=None):
+    """
+    Return the events as a JSON string in the Chrome trace event
+    format. ``sig_on()`` regions become duration events named after
+    the location of the ``sig_on()`` call, the other events become
+    instant events.
+
+    INPUT:
+
+    - ``log`` -- (default: ``None``) a list of events as returned by
+      :func:`events`. If ``None``, call :func:`events`.
+
+    EXAMPLES::
+
+        >>> import json
+        >>> from cysignals.trace import chrome_trace
+        >>> s = chrome_trace([(1000, 7, "enter", 0, "kernel.c", 42),
+        ...                   (2000, 7, "signal", 14, "kernel.c", 42),
+        ...                   (3000, 7, "exit", 0, "kernel.c", 42)])
+        >>> for ev in json.loads(s)["traceEvents"]:
+        ...     print(ev["name"], ev["ph"], ev["ts"], ev["tid"])
+        sig_on kernel.c:42 B 1.0 7
+        signal SIGALRM i 2.0 7
+        sig_on kernel.c:42 E 3.0 7
+    """
+    if log is None:
+        log = events()
+    pid = os.getpid()
+    trace_events = []
+    for time, thread, kind, sig, file, line in log:
+        ev = {"name": None, "ph": "i", "ts": time / 1000, "pid": pid, "tid": thread}
+        if kind == "enter" or kind == "exit" or kind == "recover":
+            # A recover event ends the sig_on() region
+            ev["name"] = f"sig_on {file}:{line}"
+            ev["ph"] = "B" if kind == "enter" else "E"
+        else:
+            ev["name"] = f"{kind} {signal_name(sig)}"
+            ev["s"] = "t"
+            ev["args"] = {"sig_on": f"{file}:{line}"}
+        trace_events.append(ev)
+    return json.dumps({"traceEvents": trace_events, "displayTimeUnit": "ns"})
@@ -0,0 +1,42 @@
+"""
+Tests for the static tracing probes, see docs/source/crash.rst.
+"""
+
+import shutil
+import subprocess
+import sys
+import pytest
+
+
+def probe_names(module):
+    """
+    Return the names of the ``cysignals`` probes in the ELF notes of the
+    compiled ``module``, as listed by ``readelf -n``.
+    """
+    out = subprocess.run(["readelf", "-n", module.__file__],
+                         stdout=subprocess.PIPE, universal_newlines=True,
+                         check=True).stdout
+    names = set()
+    provider = None
+    for line in out.splitlines():
+        key, _, value = line.strip().partition(": ")
+        if key == "Provider":
+            provider = value
+        elif key == "Name" and provider == "cysignals":
+            names.add(value)
+    return names
+
+
+def test_probes():
+    if not sys.platform.startswith("linux"):
+        pytest.skip("probes are only checked on Linux")
+    if shutil.which("readelf") is None:
+        pytest.skip("readelf not found")
+    tests = pytest.importorskip("cysignals.tests")
+    if not tests.have_probes():
+        pytest.skip("cysignals was compiled without sys/sdt.h")
+
+    import cysignals.signals
+    assert {"interrupt_handler", "signal_handler", "recover"} <= probe_names(cysignals.signals)
+    # sig_on() and sig_off() are inlined in every module using them
+    assert {"sig_on_prejmp", "sig_on_postjmp", "sig_off"} <= probe_names(tests)